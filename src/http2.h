@@ -0,0 +1,1427 @@
+#pragma once
+#include "http_base.h"
+#include "http_request.h"
+
+namespace tms {
+
+    // when connections speak http/2
+    enum http2_mode {
+        http2_off = 0,                  // http/1.1 only
+        http2_alpn = 1,                 // https hosts offering h2 by ALPN
+        http2_prior_knowledge = 2       // h2 by ALPN, and plain http hosts are known to speak h2c
+    };
+
+    //---------------------------------------------------------------------------------------------
+    // header compression (RFC 7541): the decoder keeps the dynamic table of the connection,
+    // the encoder writes literals without indexing, so the peer keeps no state for us
+
+    struct http2_hpack {
+        struct entry {
+            const char* name;
+            const char* value;
+        };
+
+        static const size_t static_size = 61;
+
+        static const entry* static_table() {
+            static const entry table[static_size] = {
+                { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" }, { ":path", "/" },
+                { ":path", "/index.html" }, { ":scheme", "http" }, { ":scheme", "https" }, { ":status", "200" },
+                { ":status", "204" }, { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+                { ":status", "404" }, { ":status", "500" }, { "accept-charset", "" }, { "accept-encoding", "gzip, deflate" },
+                { "accept-language", "" }, { "accept-ranges", "" }, { "accept", "" }, { "access-control-allow-origin", "" },
+                { "age", "" }, { "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+                { "content-disposition", "" }, { "content-encoding", "" }, { "content-language", "" }, { "content-length", "" },
+                { "content-location", "" }, { "content-range", "" }, { "content-type", "" }, { "cookie", "" },
+                { "date", "" }, { "etag", "" }, { "expect", "" }, { "expires", "" },
+                { "from", "" }, { "host", "" }, { "if-match", "" }, { "if-modified-since", "" },
+                { "if-none-match", "" }, { "if-range", "" }, { "if-unmodified-since", "" }, { "last-modified", "" },
+                { "link", "" }, { "location", "" }, { "max-forwards", "" }, { "proxy-authenticate", "" },
+                { "proxy-authorization", "" }, { "range", "" }, { "referer", "" }, { "refresh", "" },
+                { "retry-after", "" }, { "server", "" }, { "set-cookie", "" }, { "strict-transport-security", "" },
+                { "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" }, { "via", "" },
+                { "www-authenticate", "" }
+            };
+            return table;
+        }
+
+        // the huffman code of the spec is canonical, so it is rebuilt from code lengths of the 257 symbols
+        struct huffman_table {
+            uint32_t first[31];
+            uint16_t count[31];
+            uint16_t offset[31];
+            uint16_t symbols[257];
+
+            huffman_table() {
+                static const uint8_t lengths[257] = {
+                    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 30, 28, 28,
+                    28, 28, 28, 28, 28, 28, 28, 6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6, 5, 5, 5, 6, 6,
+                    6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10, 13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+                    7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6, 15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5, 6, 7, 6, 5, 5,
+                    6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28, 20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24,
+                    23, 24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24, 22, 21, 20, 22, 22, 23, 23, 21,
+                    23, 22, 22, 24, 21, 22, 23, 23, 21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23, 26,
+                    26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25, 19, 21, 26, 27, 27, 26, 27, 24, 21, 21,
+                    26, 26, 28, 27, 27, 27, 20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23, 26, 27, 26,
+                    26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26, 30
+                };
+                uint32_t code = 0;
+                uint16_t index = 0;
+                first[0] = count[0] = offset[0] = 0;
+                for (int length = 1; length <= 30; length++) {
+                    first[length] = code;
+                    offset[length] = index;
+                    count[length] = 0;
+                    for (uint16_t symbol = 0; symbol < 257; symbol++) {
+                        if (lengths[symbol] == length) {
+                            symbols[index++] = symbol;
+                            count[length]++;
+                        }
+                    }
+                    code = (code + count[length]) << 1;
+                }
+            }
+        };
+
+        static bool huffman_decode(const uint8_t* data, size_t size, std::string& out) {
+            static const huffman_table table;
+            uint32_t code = 0;
+            int length = 0;
+            for (size_t i = 0; i < size; i++) {
+                for (int bit = 7; bit >= 0; bit--) {
+                    code = (code << 1) | ((data[i] >> bit) & 1);
+                    if (++length > 30) return false;
+                    auto index = code - table.first[length];
+                    if (code >= table.first[length] && index < table.count[length]) {
+                        auto symbol = table.symbols[table.offset[length] + index];
+                        if (symbol == 256) return false;
+                        out.push_back(static_cast<char>(symbol));
+                        code = 0;
+                        length = 0;
+                    }
+                }
+            }
+            // padding is the beginning of EOS, all ones, shorter than a byte
+            return length < 8 && code == (1u << length) - 1;
+        }
+
+        static bool decode_integer(const uint8_t*& p, const uint8_t* end, int prefix, size_t& value) {
+            if (p >= end) return false;
+            size_t mask = (1u << prefix) - 1;
+            value = *p++ & mask;
+            if (value < mask) return true;
+            for (int shift = 0; p < end && shift < 28; shift += 7) {
+                auto byte = *p++;
+                value += static_cast<size_t>(byte & 0x7f) << shift;
+                if ((byte & 0x80) == 0) return true;
+            }
+            return false;
+        }
+
+        static bool decode_string(const uint8_t*& p, const uint8_t* end, std::string& out) {
+            if (p >= end) return false;
+            auto huffman = (*p & 0x80) != 0;
+            size_t size = 0;
+            if (!decode_integer(p, end, 7, size) || size > static_cast<size_t>(end - p)) return false;
+            out.clear();
+            if (huffman) {
+                if (!huffman_decode(p, size, out)) return false;
+            }
+            else {
+                out.assign(reinterpret_cast<const char*>(p), size);
+            }
+            p += size;
+            return true;
+        }
+
+        static void encode_integer(std::string& out, uint8_t first, int prefix, size_t value) {
+            size_t mask = (1u << prefix) - 1;
+            if (value < mask) {
+                out.push_back(static_cast<char>(first | value));
+                return;
+            }
+            out.push_back(static_cast<char>(first | mask));
+            value -= mask;
+            while (value >= 128) {
+                out.push_back(static_cast<char>(value % 128 + 128));
+                value /= 128;
+            }
+            out.push_back(static_cast<char>(value));
+        }
+
+        static void encode_string(std::string& out, http_string value) {
+            encode_integer(out, 0, 7, value.size());
+            out.append(value.data(), value.size());
+        }
+
+        // fully indexed field of the static table, or literal without indexing with the name from it if any
+        static void encode_field(std::string& out, http_string name, http_string value) {
+            auto table = static_table();
+            size_t named = 0;
+            for (size_t i = 0; i < static_size; i++) {
+                if (name == table[i].name) {
+                    if (value == table[i].value) {
+                        encode_integer(out, 0x80, 7, i + 1);
+                        return;
+                    }
+                    if (named == 0) {
+                        named = i + 1;
+                    }
+                }
+            }
+            if (named > 0) {
+                encode_integer(out, 0, 4, named);
+            }
+            else {
+                out.push_back(0);
+                encode_string(out, name);
+            }
+            encode_string(out, value);
+        }
+    };
+
+    typedef std::vector<std::pair<std::string, std::string> > http2_fields;
+
+    class http2_hpack_decoder {
+    public:
+        // header block into fields, false on compression error
+        bool decode(const uint8_t* p, size_t size, http2_fields& fields) {
+            auto end = p + size;
+            std::string name, value;
+            while (p < end) {
+                auto byte = *p;
+                size_t index = 0;
+                if (byte & 0x80) {
+                    if (!http2_hpack::decode_integer(p, end, 7, index) || !get(index, name, value)) return false;
+                    fields.emplace_back(name, value);
+                }
+                else if ((byte & 0xe0) == 0x20) {
+                    if (!http2_hpack::decode_integer(p, end, 5, index) || index > limit) return false;
+                    max_size = index;
+                    evict(0);
+                }
+                else {
+                    auto indexing = (byte & 0xc0) == 0x40;
+                    if (!http2_hpack::decode_integer(p, end, indexing ? 6 : 4, index)) return false;
+                    if (index == 0) {
+                        if (!http2_hpack::decode_string(p, end, name)) return false;
+                    }
+                    else if (!get(index, name, value)) {
+                        return false;
+                    }
+                    if (!http2_hpack::decode_string(p, end, value)) return false;
+                    if (indexing) {
+                        add(name, value);
+                    }
+                    fields.emplace_back(name, value);
+                }
+            }
+            return true;
+        }
+
+    private:
+        std::deque<std::pair<std::string, std::string> > table;
+        size_t size = 0;
+        size_t max_size = 4096;
+        size_t limit = 4096;
+
+        bool get(size_t index, std::string& name, std::string& value) {
+            if (index == 0) return false;
+            if (index <= http2_hpack::static_size) {
+                auto& entry = http2_hpack::static_table()[index - 1];
+                name = entry.name;
+                value = entry.value;
+                return true;
+            }
+            index -= http2_hpack::static_size + 1;
+            if (index >= table.size()) return false;
+            name = table[index].first;
+            value = table[index].second;
+            return true;
+        }
+
+        void add(const std::string& name, const std::string& value) {
+            auto entry_size = name.size() + value.size() + 32;
+            evict(entry_size);
+            if (entry_size <= max_size) {
+                table.emplace_front(name, value);
+                size += entry_size;
+            }
+        }
+
+        // room for the new entry
+        void evict(size_t room) {
+            while (!table.empty() && size + room > max_size) {
+                size -= table.back().first.size() + table.back().second.size() + 32;
+                table.pop_back();
+            }
+        }
+    };
+
+    //---------------------------------------------------------------------------------------------
+    // frames (RFC 7540 section 6)
+
+    struct http2_frame {
+        enum type {
+            data = 0,
+            headers = 1,
+            priority = 2,
+            rst_stream = 3,
+            settings = 4,
+            push_promise = 5,
+            ping = 6,
+            goaway = 7,
+            window_update = 8,
+            continuation = 9
+        };
+
+        enum flags {
+            end_stream = 0x1,
+            ack = 0x1,
+            end_headers = 0x4,
+            padded = 0x8,
+            priority_flag = 0x20
+        };
+
+        enum setting {
+            header_table_size = 1,
+            enable_push = 2,
+            max_concurrent_streams = 3,
+            initial_window_size = 4,
+            max_frame_size = 5,
+            max_header_list_size = 6
+        };
+
+        static const size_t header_size = 9;
+        static const size_t default_frame_size = 16384;
+        static const size_t default_window = 65535;
+        static const int64_t max_window = 0x7fffffff;
+
+        static void header(std::string& out, size_t length, uint8_t type, uint8_t flags, uint32_t stream) {
+            char head[header_size] = {
+                static_cast<char>(length >> 16), static_cast<char>(length >> 8), static_cast<char>(length),
+                static_cast<char>(type), static_cast<char>(flags),
+                static_cast<char>((stream >> 24) & 0x7f), static_cast<char>(stream >> 16), static_cast<char>(stream >> 8), static_cast<char>(stream)
+            };
+            out.append(head, header_size);
+        }
+
+        static void append32(std::string& out, uint32_t value) {
+            char data[4] = { static_cast<char>(value >> 24), static_cast<char>(value >> 16), static_cast<char>(value >> 8), static_cast<char>(value) };
+            out.append(data, 4);
+        }
+
+        static uint32_t read32(const uint8_t* p) {
+            return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) | (static_cast<uint32_t>(p[2]) << 8) | p[3];
+        }
+    };
+
+    //---------------------------------------------------------------------------------------------
+    // a request on its own stream of the connection, the stream looks like http/1.1 connection to the request,
+    // so any request type goes over it as is: the request written by beast turns into HEADERS and DATA frames,
+    // the response frames turn into http/1.1 response read by the beast parser of the request
+
+    class http2_stream;
+
+    // connection of the streams, called on the connection strand
+    class http2_connection {
+    public:
+        virtual ~http2_connection() {}
+        virtual void send_headers(http2_stream& stream, const std::string& block, bool end_stream) = 0;
+        virtual void send_data(http2_stream& stream) = 0;
+        virtual void send_reset(http2_stream& stream, http2_errc code) = 0;
+        virtual void send_window(http2_stream& stream, size_t credit) = 0;
+        virtual void complete(http2_stream& stream, http_stage stage, http_error err, size_t transferred) = 0;
+        // a stream timed out, the peer must answer a PING or the connection is dropped
+        virtual void check_alive() = 0;
+    };
+
+    class http2_stream :
+        public http_process_target,
+        public std::enable_shared_from_this<http2_stream>
+    {
+    public:
+        typedef asio_io_executor executor_type;
+
+        http2_stream(std::shared_ptr<http2_connection> c, const asio_strand& ex, http_request_ptr req, unsigned int gen, bool _secure)
+            : request(std::move(req)), generation(gen), connection(std::move(c)), executor(ex), timer(ex), secure(_secure)
+        {}
+
+        // request of the stream and generation of the connection that opened it
+        http_request_ptr request;
+        unsigned int generation;
+
+        // the request failed to write, the response is not waited for
+        http_error write_error;
+
+        // read buffer of the request parser, as of http_stream_t
+        beast::flat_buffer buffer;
+
+        inline http2_stream* get() {
+            return this;
+        }
+
+        bool resumed() {
+            return false;
+        }
+
+        // the stream itself holds what its operations need, null if the connection is gone
+        std::shared_ptr<http2_stream> current_layer() {
+            return connection ? shared_from_this() : nullptr;
+        }
+
+        // call f with the stream, false if the connection is gone
+        template<typename F>
+        bool visit(F&& f) {
+            if (!connection) return false;
+            f(*this);
+            return true;
+        }
+
+        // stage timeout, cut by the deadline of the request if any, the stream is reset after it
+        void expires_after(unsigned int secs, steady_clock::time_point until = steady_clock::time_point()) {
+            timeout = secs;
+            deadline = until;
+            extend();
+        }
+
+        void extend() {
+            if (!connection) return;
+            auto at = steady_clock::now() + std::chrono::seconds(timeout);
+            if (deadline != steady_clock::time_point() && deadline < at) {
+                at = deadline;
+            }
+            timer.expires_at(at);
+            std::weak_ptr<http2_stream> weak = shared_from_this();
+            timer.async_wait([weak](http_error err) {
+                auto self = weak.lock();
+                if (!err && self) {
+                    self->on_timeout();
+                }
+            });
+        }
+
+        executor_type get_executor() {
+            return executor;
+        }
+
+        // the response as http/1.1 message
+        template<typename buffers_type, typename handler_type>
+        void async_read_some(const buffers_type& buffers, handler_type&& handler) {
+            reader.reset(new pending_read<buffers_type, typename std::decay<handler_type>::type>(buffers, std::forward<handler_type>(handler)));
+            deliver();
+        }
+
+        // the request as http/1.1 message, the handler waits while much of the body is not sent
+        template<typename buffers_type, typename handler_type>
+        void async_write_some(const buffers_type& buffers, handler_type&& handler) {
+            std::unique_ptr<pending_op> op(new pending_handler<typename std::decay<handler_type>::type>(std::forward<handler_type>(handler)));
+            if (error || !connection) {
+                return op->complete(executor, error ? error : http_error(asio::error::connection_aborted), 0);
+            }
+            auto size = beast::buffer_bytes(buffers);
+            staged.commit(asio::buffer_copy(staged.prepare(size), buffers));
+            if (!translate()) {
+                connection->send_reset(*this, http2_errc::internal_error);
+                fail(http2_errc::internal_error);
+            }
+            if (error) {
+                return op->complete(executor, error, 0);
+            }
+            if (outgoing.size() > write_limit) {
+                writer = std::move(op);
+                writer_size = size;
+                return;
+            }
+            op->complete(executor, http_error(), size);
+        }
+
+        virtual void on_process(unsigned int, http_stage stage, http_error err, size_t transferred) {
+            if (connection) {
+                connection->complete(*this, stage, err, transferred);
+            }
+        }
+
+        // requests are cancelled by the client holding them
+        virtual void on_cancel(http_request*) {}
+
+        // the stream is reset or the connection failed, pending operations complete with the error
+        void fail(http_error err) {
+            if (!error) {
+                error = err;
+            }
+            if (writer) {
+                auto op = std::move(writer);
+                op->complete(executor, error, 0);
+            }
+            deliver();
+        }
+
+        // the connection is gone, the request stays until its pending operations complete
+        void detach(http_error err) {
+            fail(err);
+            connection.reset();
+            timer.cancel();
+        }
+
+    private:
+        template<typename> friend class http2_session;
+
+        struct pending_op {
+            virtual ~pending_op() {}
+            virtual size_t copy(const beast::flat_buffer::const_buffers_type&) { return 0; }
+            virtual void complete(const asio_strand& ex, http_error err, size_t transferred) = 0;
+        };
+
+        template<typename handler_type>
+        struct pending_handler : pending_op {
+            handler_type handler;
+
+            template<typename H>
+            explicit pending_handler(H&& h)
+                : handler(std::forward<H>(h))
+            {}
+
+            // never inline, the operation may be just started
+            virtual void complete(const asio_strand& ex, http_error err, size_t transferred) {
+                auto h = asio::get_associated_executor(handler, ex);
+                asio::post(h, beast::bind_front_handler(std::move(handler), err, transferred));
+            }
+        };
+
+        template<typename buffers_type, typename handler_type>
+        struct pending_read : pending_handler<handler_type> {
+            buffers_type buffers;
+
+            template<typename H>
+            pending_read(const buffers_type& b, H&& h)
+                : pending_handler<handler_type>(std::forward<H>(h)), buffers(b)
+            {}
+
+            virtual size_t copy(const beast::flat_buffer::const_buffers_type& data) {
+                return asio::buffer_copy(buffers, data);
+            }
+        };
+
+        enum translate_state {
+            state_header,
+            state_body,
+            state_chunk_size,
+            state_chunk_data,
+            state_chunk_end,
+            state_trailer,
+            state_done
+        };
+
+        static const size_t write_limit = 65536;
+        static const size_t credit_threshold = 32768;
+
+        std::shared_ptr<http2_connection> connection;
+        asio_strand executor;
+        asio_timer timer;
+        unsigned int timeout = 0;
+        steady_clock::time_point deadline;
+        bool secure;
+        http_error error;
+
+        // stream state kept by the connection
+        uint32_t id = 0;
+        int64_t window = 0;
+        bool queued = false;
+        bool local_closed = false;
+        bool remote_closed = false;
+
+        // request side: written bytes not translated yet, body bytes to send as DATA
+        std::unique_ptr<pending_op> writer;
+        size_t writer_size = 0;
+        beast::flat_buffer staged;
+        beast::flat_buffer outgoing;
+        translate_state state = state_header;
+        size_t remaining = 0;
+        bool end_pending = false;
+
+        // response side: http/1.1 bytes for the parser, DATA payload not credited back yet
+        std::unique_ptr<pending_op> reader;
+        beast::flat_buffer incoming;
+        bool head_done = false;
+        bool chunked = false;
+        size_t uncredited = 0;
+        size_t credit = 0;
+
+        void on_timeout() {
+            if (!connection) return;
+            auto c = connection;
+            c->send_reset(*this, http2_errc::cancel);
+            fail(beast::error::timeout);
+            c->check_alive();
+        }
+
+        void append(beast::flat_buffer& buffer, http_string data) {
+            buffer.commit(asio::buffer_copy(buffer.prepare(data.size()), asio::buffer(data.data(), data.size())));
+        }
+
+        // the request as beast writes it: header, then the body by content-length or chunked
+        bool translate() {
+            for (;;) {
+                auto data = staged.data();
+                http_string text(static_cast<const char*>(data.data()), data.size());
+                switch (state) {
+                case state_header: {
+                    auto pos = text.find("\r\n\r\n");
+                    if (pos == http_string::npos) return text.size() < 65536;
+                    if (!send_header(text.substr(0, pos + 2))) return false;
+                    staged.consume(pos + 4);
+                    break;
+                }
+                case state_body:
+                case state_chunk_data: {
+                    auto size = std::min(remaining, text.size());
+                    if (size == 0) return true;
+                    append(outgoing, text.substr(0, size));
+                    staged.consume(size);
+                    remaining -= size;
+                    if (remaining == 0) {
+                        if (state == state_body) {
+                            finish_body();
+                        }
+                        else {
+                            state = state_chunk_end;
+                        }
+                    }
+                    connection->send_data(*this);
+                    break;
+                }
+                case state_chunk_size: {
+                    auto pos = text.find("\r\n");
+                    if (pos == http_string::npos) return text.size() < 1024;
+                    auto size = std::strtoul(std::string(text.substr(0, pos)).c_str(), nullptr, 16);
+                    staged.consume(pos + 2);
+                    if (size == 0) {
+                        state = state_trailer;
+                    }
+                    else {
+                        remaining = size;
+                        state = state_chunk_data;
+                    }
+                    break;
+                }
+                case state_chunk_end: {
+                    if (text.size() < 2) return true;
+                    staged.consume(2);
+                    state = state_chunk_size;
+                    break;
+                }
+                case state_trailer: {
+                    // trailer fields are dropped
+                    auto pos = text.find("\r\n");
+                    if (pos == http_string::npos) return text.size() < 65536;
+                    staged.consume(pos + 2);
+                    if (pos == 0) {
+                        finish_body();
+                        connection->send_data(*this);
+                    }
+                    break;
+                }
+                case state_done:
+                    return text.empty();
+                }
+            }
+        }
+
+        // request line and fields into HEADERS, connection specific fields are dropped
+        bool send_header(http_string head) {
+            auto line = head.find("\r\n");
+            auto first = head.find(' ');
+            auto last = head.substr(0, line).rfind(' ');
+            if (first == http_string::npos || last == http_string::npos || last <= first) return false;
+            auto method = head.substr(0, first);
+            auto target = head.substr(first + 1, last - first - 1);
+
+            http2_fields fields;
+            std::string authority;
+            int64_t length = -1;
+            auto chunked_body = false;
+            for (auto pos = line + 2; pos < head.size();) {
+                auto end = head.find("\r\n", pos);
+                auto field = head.substr(pos, end - pos);
+                pos = end + 2;
+                auto colon = field.find(':');
+                if (colon == http_string::npos) return false;
+                std::string name(field.substr(0, colon));
+                std::transform(name.begin(), name.end(), name.begin(), [](char c) { return static_cast<char>(std::tolower(static_cast<unsigned char>(c))); });
+                auto value = field.substr(colon + 1);
+                while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) value.remove_prefix(1);
+                while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) value.remove_suffix(1);
+                if (name == "host") {
+                    authority = std::string(value);
+                    continue;
+                }
+                if (name == "transfer-encoding") {
+                    chunked_body = value.find("chunked") != http_string::npos;
+                    continue;
+                }
+                if (name == "connection" || name == "keep-alive" || name == "proxy-connection" || name == "upgrade" || (name == "te" && value != "trailers")) {
+                    continue;
+                }
+                if (name == "content-length") {
+                    length = std::strtoll(std::string(value).c_str(), nullptr, 10);
+                }
+                fields.emplace_back(std::move(name), std::string(value));
+            }
+
+            std::string block;
+            http2_hpack::encode_field(block, ":method", method);
+            http2_hpack::encode_field(block, ":scheme", secure ? "https" : "http");
+            http2_hpack::encode_field(block, ":authority", authority);
+            http2_hpack::encode_field(block, ":path", target);
+            for (auto& field : fields) {
+                http2_hpack::encode_field(block, field.first, field.second);
+            }
+
+            auto end_stream = !chunked_body && length <= 0;
+            if (chunked_body) {
+                state = state_chunk_size;
+            }
+            else if (length > 0) {
+                state = state_body;
+                remaining = static_cast<size_t>(length);
+            }
+            else {
+                state = state_done;
+            }
+            connection->send_headers(*this, block, end_stream);
+            return true;
+        }
+
+        void finish_body() {
+            state = state_done;
+            end_pending = true;
+        }
+
+        // DATA frames went out, the waiting write completes when little is left
+        void on_sent() {
+            if (writer && outgoing.size() <= write_limit) {
+                auto op = std::move(writer);
+                op->complete(executor, http_error(), writer_size);
+            }
+        }
+
+        void on_headers(http2_fields& fields, bool end_stream) {
+            if (head_done) {
+                // trailer fields are dropped
+                if (end_stream) {
+                    end_body();
+                }
+                return deliver();
+            }
+            unsigned status = 0;
+            for (auto& field : fields) {
+                if (field.first == ":status") {
+                    status = static_cast<unsigned>(std::atoi(field.second.c_str()));
+                }
+            }
+            if (status < 100 || status > 999) {
+                connection->send_reset(*this, http2_errc::protocol_error);
+                return fail(http2_errc::protocol_error);
+            }
+
+            // informational responses are skipped
+            if (status < 200) return;
+
+            std::string head = "HTTP/1.1 ";
+            head += std::to_string(status);
+            head += " ";
+            auto reason = http::obsolete_reason(static_cast<http::status>(status));
+            head.append(reason.data(), reason.size());
+            head += "\r\n";
+            auto length = false;
+            for (auto& field : fields) {
+                auto& name = field.first;
+                if (name.empty() || name[0] == ':' || name == "connection" || name == "transfer-encoding" || name == "keep-alive") continue;
+                if (name == "content-length") {
+                    if (end_stream) continue;
+                    length = true;
+                }
+                head += name;
+                head += ": ";
+                head += field.second;
+                head += "\r\n";
+            }
+            chunked = !end_stream && !length;
+            if (end_stream) {
+                head += "content-length: 0\r\n";
+            }
+            else if (chunked) {
+                head += "transfer-encoding: chunked\r\n";
+            }
+            head += "\r\n";
+            append(incoming, head);
+            head_done = true;
+            remote_closed = end_stream;
+            deliver();
+        }
+
+        void on_data(const uint8_t* data, size_t size, size_t frame_size, bool end_stream) {
+            uncredited += frame_size;
+            if (!head_done) {
+                connection->send_reset(*this, http2_errc::protocol_error);
+                return fail(http2_errc::protocol_error);
+            }
+            if (size > 0) {
+                if (chunked) {
+                    char hex[20];
+                    auto pos = sizeof(hex);
+                    hex[--pos] = '\n';
+                    hex[--pos] = '\r';
+                    for (auto value = size; value > 0; value >>= 4) {
+                        hex[--pos] = "0123456789abcdef"[value & 0xf];
+                    }
+                    append(incoming, http_string(hex + pos, sizeof(hex) - pos));
+                }
+                append(incoming, http_string(reinterpret_cast<const char*>(data), size));
+                if (chunked) {
+                    append(incoming, "\r\n");
+                }
+            }
+            if (end_stream) {
+                end_body();
+            }
+            deliver();
+        }
+
+        void end_body() {
+            if (chunked) {
+                append(incoming, "0\r\n\r\n");
+            }
+            remote_closed = true;
+        }
+
+        // buffered bytes first, then the error or the end
+        void deliver() {
+            if (!reader || (incoming.size() == 0 && !remote_closed && !error)) return;
+            auto op = std::move(reader);
+            if (incoming.size() > 0) {
+                auto size = op->copy(incoming.data());
+                incoming.consume(size);
+                consumed(size);
+                return op->complete(executor, http_error(), size);
+            }
+            op->complete(executor, error ? error : http_error(http::error::end_of_stream), 0);
+        }
+
+        // read bytes give the window back to the peer, at most as much as DATA payload received
+        void consumed(size_t size) {
+            auto value = std::min(size, uncredited);
+            uncredited -= value;
+            credit += value;
+            if (connection && credit > 0 && (credit >= credit_threshold || incoming.size() == 0)) {
+                connection->send_window(*this, credit);
+                credit = 0;
+            }
+        }
+    };
+
+    typedef std::shared_ptr<http2_stream> http2_stream_ptr;
+
+    //---------------------------------------------------------------------------------------------
+    // http/2 connection over the client's stream, runs on the client strand
+
+    class http2_session_owner {
+    public:
+        virtual ~http2_session_owner() {}
+        // write or read of the stream's request completed
+        virtual void on_stream(http2_stream& stream, http_stage stage, http_error err, size_t transferred) = 0;
+        // connection failed, or without error it may take more streams
+        virtual void on_session(http_error err) = 0;
+    };
+
+    template<typename stream_type>
+    class http2_session :
+        public http2_connection,
+        public std::enable_shared_from_this<http2_session<stream_type> >
+    {
+    public:
+        static const size_t max_streams = 100;
+        static const size_t stream_window = 1 << 20;
+        static const size_t connection_window = 1 << 24;
+        static const size_t max_header_list = 1 << 16;
+        static const int ping_timeout = 10;     // seconds
+
+        http2_session(stream_type& s, const asio_strand& ex)
+            : stream(s), executor(ex), ping_timer(ex)
+        {}
+
+        // preface and settings, the socket has no timeout from now on, streams have their own ones
+        // and a timed out stream makes the peer answer a PING;
+        // small frames (window updates, acks) go out at once, without waiting for Nagle's algorithm
+        void start(std::shared_ptr<http2_session_owner> o) {
+            owner = std::move(o);
+            stream.expires_never();
+            if (auto s = stream.get()) {
+                http_error ignored;
+                s->socket().set_option(tcp::no_delay(true), ignored);
+            }
+            output.append("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n");
+            http2_frame::header(output, 18, http2_frame::settings, 0, 0);
+            setting(http2_frame::enable_push, 0);
+            setting(http2_frame::initial_window_size, stream_window);
+            setting(http2_frame::max_header_list_size, max_header_list);
+            http2_frame::header(output, 4, http2_frame::window_update, 0, 0);
+            http2_frame::append32(output, connection_window - http2_frame::default_window);
+            flush();
+            read();
+        }
+
+        // streams the peer allows at once
+        size_t capacity() {
+            if (going_away) return 0;
+            return peer_streams < max_streams ? peer_streams : max_streams;
+        }
+
+        bool can_open() {
+            return !closed && streams.size() < capacity();
+        }
+
+        bool is_going_away() {
+            return going_away;
+        }
+
+        http2_stream_ptr open(http_request_ptr req, unsigned int gen) {
+            auto s = std::make_shared<http2_stream>(this->shared_from_this(), executor, std::move(req), gen, bool(stream_type::secure));
+            streams.push_back(s);
+            return s;
+        }
+
+        // request of the stream completed: reset it if still open, return the unread window
+        void finish(http2_stream& s) {
+            if (s.id != 0 && !(s.local_closed && s.remote_closed)) {
+                send_reset(s, http2_errc::cancel);
+            }
+            auto credit = s.uncredited + s.credit;
+            s.uncredited = s.credit = 0;
+            if (credit > 0 && !closed) {
+                window_update(0, credit);
+                flush();
+            }
+            auto ptr = std::find_if(streams.begin(), streams.end(), [&s](const http2_stream_ptr& p) { return p.get() == &s; });
+            if (ptr != streams.end()) {
+                auto keep = std::move(*ptr);
+                streams.erase(ptr);
+                keep->detach(asio::error::operation_aborted);
+            }
+        }
+
+        // cancelled request leaves its stream
+        void cancel(const http_request* req) {
+            auto ptr = std::find_if(streams.begin(), streams.end(), [req](const http2_stream_ptr& p) { return p->request.get() == req; });
+            if (ptr == streams.end()) return;
+            auto s = *ptr;
+            send_reset(*s, http2_errc::cancel);
+            s->fail(asio::error::operation_aborted);
+            finish(*s);
+        }
+
+        // streams complete as outdated ones, the owner is not called any more
+        // a second close drops the GOAWAY still being written, the owner has dropped the connection
+        void close() {
+            if (closed) {
+                leaving.reset();
+                ping_timer.cancel();
+                return;
+            }
+            closed = true;
+            pinging = false;
+            ping_timer.cancel();
+            owner.reset();
+            auto list = std::move(streams);
+            streams.clear();
+            for (auto& s : list) {
+                s->detach(asio::error::connection_aborted);
+            }
+        }
+
+        virtual void send_headers(http2_stream& s, const std::string& block, bool end_stream) {
+            if (closed || going_away) {
+                return s.fail(make_error_code(http2_errc::refused_stream));
+            }
+            s.id = next_id;
+            next_id += 2;
+            s.window = static_cast<int64_t>(peer_window);
+            if (next_id > 0x7fffffff) {
+                going_away = true;
+            }
+
+            // the first part in HEADERS, the rest in CONTINUATION frames
+            size_t pos = 0;
+            auto type = http2_frame::headers;
+            do {
+                auto size = std::min(block.size() - pos, peer_frame);
+                uint8_t flags = 0;
+                if (pos + size == block.size()) flags |= http2_frame::end_headers;
+                if (type == http2_frame::headers && end_stream) flags |= http2_frame::end_stream;
+                http2_frame::header(output, size, static_cast<uint8_t>(type), flags, s.id);
+                output.append(block, pos, size);
+                pos += size;
+                type = http2_frame::continuation;
+            } while (pos < block.size());
+            if (end_stream) {
+                s.local_closed = true;
+            }
+            flush();
+        }
+
+        virtual void send_data(http2_stream& s) {
+            if (closed) return;
+            if (!s.queued && s.id != 0 && !s.local_closed) {
+                s.queued = true;
+                ready.push_back(s.shared_from_this());
+            }
+            pump();
+            flush();
+        }
+
+        virtual void send_reset(http2_stream& s, http2_errc code) {
+            if (closed || s.id == 0 || (s.local_closed && s.remote_closed)) return;
+            s.local_closed = s.remote_closed = true;
+            http2_frame::header(output, 4, http2_frame::rst_stream, 0, s.id);
+            http2_frame::append32(output, static_cast<uint32_t>(code));
+            flush();
+        }
+
+        virtual void send_window(http2_stream& s, size_t credit) {
+            if (closed) return;
+            if (!s.remote_closed && s.id != 0) {
+                window_update(s.id, credit);
+            }
+            window_update(0, credit);
+            flush();
+        }
+
+        // nothing read till the timeout fails the connection with beast::error::timeout
+        virtual void check_alive() {
+            if (closed || pinging) return;
+            pinging = true;
+            http2_frame::header(output, 8, http2_frame::ping, 0, 0);
+            output.append(8, '\0');
+            flush();
+            ping_timer.expires_after(std::chrono::seconds(int(ping_timeout)));
+            std::weak_ptr<http2_session> weak = this->shared_from_this();
+            ping_timer.async_wait([weak](http_error err) {
+                auto self = weak.lock();
+                if (!err && self && self->pinging) {
+                    self->fail(beast::error::timeout);
+                }
+            });
+        }
+
+        // the owner may drop the session meanwhile
+        virtual void complete(http2_stream& s, http_stage stage, http_error err, size_t transferred) {
+            auto self = this->shared_from_this();
+            if (owner) {
+                owner->on_stream(s, stage, err, transferred);
+            }
+        }
+
+    private:
+        stream_type& stream;
+        asio_strand executor;
+        std::shared_ptr<http2_session_owner> owner;
+        std::vector<http2_stream_ptr> streams;
+        std::deque<http2_stream_ptr> ready;
+        http2_hpack_decoder decoder;
+        beast::flat_buffer input;
+        std::string output, sending;
+        bool writing = false;
+        bool closed = false;
+        bool going_away = false;
+        uint32_t next_id = 1;
+
+        // PING sent after a stream timeout, any bytes read answer it
+        asio_timer ping_timer;
+        bool pinging = false;
+
+        // peer settings and the connection send window
+        size_t peer_streams = std::numeric_limits<uint32_t>::max();
+        size_t peer_window = http2_frame::default_window;
+        size_t peer_frame = http2_frame::default_frame_size;
+        int64_t window = http2_frame::default_window;
+
+        // header block split in CONTINUATION frames
+        std::string block;
+        uint32_t block_stream = 0;
+        bool block_end_stream = false;
+
+        // the owner told of a connection error once GOAWAY is written
+        std::shared_ptr<http2_session_owner> leaving;
+        http_error leaving_error;
+
+        void setting(uint16_t id, uint32_t value) {
+            char data[2] = { static_cast<char>(id >> 8), static_cast<char>(id) };
+            output.append(data, 2);
+            http2_frame::append32(output, value);
+        }
+
+        void window_update(uint32_t id, size_t credit) {
+            http2_frame::header(output, 4, http2_frame::window_update, 0, id);
+            http2_frame::append32(output, static_cast<uint32_t>(credit));
+        }
+
+        http2_stream* find(uint32_t id) {
+            for (auto& s : streams) {
+                if (s->id == id) return s.get();
+            }
+            return nullptr;
+        }
+
+        // DATA frames of the ready streams in turn, as much as windows and the output limit allow
+        void pump() {
+            while (!ready.empty() && output.size() < 65536) {
+                auto s = std::move(ready.front());
+                ready.pop_front();
+                s->queued = false;
+                if (s->local_closed || s->error) continue;
+                auto pending = s->outgoing.size();
+                auto size = std::min({ pending, static_cast<size_t>(std::max<int64_t>(s->window, 0)), static_cast<size_t>(std::max<int64_t>(window, 0)), peer_frame });
+                auto end = s->end_pending && size == pending;
+                if (size == 0 && !end) {
+                    // the connection window is over, the stream one waits for its WINDOW_UPDATE
+                    if (pending > 0 && s->window > 0) {
+                        s->queued = true;
+                        ready.push_front(std::move(s));
+                        break;
+                    }
+                    continue;
+                }
+                http2_frame::header(output, size, http2_frame::data, end ? http2_frame::end_stream : 0, s->id);
+                auto data = s->outgoing.data();
+                output.append(static_cast<const char*>(data.data()), size);
+                s->outgoing.consume(size);
+                s->window -= size;
+                window -= size;
+                if (end) {
+                    s->local_closed = true;
+                }
+                s->on_sent();
+                if (!end && (s->outgoing.size() > 0 || s->end_pending)) {
+                    s->queued = true;
+                    ready.push_back(std::move(s));
+                }
+            }
+        }
+
+        void flush() {
+            if (writing || output.empty() || closed) return;
+            writing = true;
+            sending.swap(output);
+            output.clear();
+
+            // the operation holds the layer, the owner may reset the stream meanwhile
+            auto layer = stream.layer;
+            if (!layer) {
+                writing = false;
+                return;
+            }
+            auto self = this->shared_from_this();
+            asio::async_write(*layer, asio::buffer(sending), [self, layer](http_error err, size_t) {
+                self->on_write(err);
+            });
+        }
+
+        void on_write(http_error err) {
+            writing = false;
+            if (closed) {
+                if (leaving) depart(err);
+                return;
+            }
+            if (err) return fail(err);
+            sending.clear();
+            pump();
+            flush();
+        }
+
+        void read() {
+            auto layer = stream.layer;
+            if (!layer) return;
+            auto self = this->shared_from_this();
+            layer->async_read_some(input.prepare(65536), [self, layer](http_error err, size_t transferred) {
+                self->on_read(err, transferred);
+            });
+        }
+
+        void on_read(http_error err, size_t transferred) {
+            if (closed) return;
+            if (err) return fail(err);
+            if (pinging) {
+                pinging = false;
+                ping_timer.cancel();
+            }
+            input.commit(transferred);
+            if (parse()) {
+                read();
+            }
+        }
+
+        // a connection error found here goes to the peer in GOAWAY before the owner drops the connection
+        // (RFC 7540 section 5.4.1), the owner learns of it when GOAWAY is written or the ping timeout expires
+        void fail(http_error err) {
+            auto o = std::move(owner);
+            auto tell = !closed && err.category() == http2_category() && stream.layer;
+            close();
+            if (!o) return;
+            if (!tell) return o->on_session(err);
+            output.clear();
+            http2_frame::header(output, 8, http2_frame::goaway, 0, 0);
+            http2_frame::append32(output, 0);   // the last stream the peer started, it starts none
+            http2_frame::append32(output, static_cast<uint32_t>(err.value()));
+            leaving = std::move(o);
+            leaving_error = err;
+            ping_timer.expires_after(std::chrono::seconds(int(ping_timeout)));
+            std::weak_ptr<http2_session> weak = this->shared_from_this();
+            ping_timer.async_wait([weak](http_error e) {
+                auto self = weak.lock();
+                if (!e && self && self->leaving) {
+                    self->leave();
+                }
+            });
+            if (!writing) depart(http_error());
+        }
+
+        // GOAWAY after the write in progress, then the owner
+        void depart(http_error err) {
+            auto layer = stream.layer;
+            if (err || output.empty() || !layer) return leave();
+            writing = true;
+            sending.swap(output);
+            output.clear();
+            auto self = this->shared_from_this();
+            asio::async_write(*layer, asio::buffer(sending), [self, layer](http_error err, size_t) {
+                self->on_write(err);
+            });
+        }
+
+        void leave() {
+            ping_timer.cancel();
+            auto o = std::move(leaving);
+            if (o) {
+                o->on_session(leaving_error);
+            }
+        }
+
+        bool parse() {
+            for (;;) {
+                auto data = input.data();
+                auto p = static_cast<const uint8_t*>(data.data());
+                if (data.size() < http2_frame::header_size) return true;
+                size_t length = (static_cast<size_t>(p[0]) << 16) | (static_cast<size_t>(p[1]) << 8) | p[2];
+                if (length > http2_frame::default_frame_size) {
+                    fail(http2_errc::frame_size_error);
+                    return false;
+                }
+                if (data.size() < http2_frame::header_size + length) return true;
+                auto id = http2_frame::read32(p + 5) & 0x7fffffff;
+                auto err = on_frame(p[3], p[4], id, p + http2_frame::header_size, length);
+                if (err != http2_errc::no_error) {
+                    fail(err);
+                    return false;
+                }
+                if (closed) return false;
+                input.consume(http2_frame::header_size + length);
+            }
+        }
+
+        // padding and priority of DATA and HEADERS are skipped
+        static bool unpad(uint8_t flags, const uint8_t*& p, size_t& length) {
+            if (flags & http2_frame::padded) {
+                if (length < 1 || p[0] >= length) return false;
+                length -= 1 + p[0];
+                p++;
+            }
+            return true;
+        }
+
+        http2_errc on_frame(uint8_t type, uint8_t flags, uint32_t id, const uint8_t* p, size_t length) {
+            if (block_stream != 0 && type != http2_frame::continuation) {
+                return http2_errc::protocol_error;
+            }
+            switch (type) {
+            case http2_frame::data: {
+                if (id == 0) return http2_errc::protocol_error;
+                auto frame_size = length;
+                if (!unpad(flags, p, length)) return http2_errc::protocol_error;
+                auto s = find(id);
+                if (!s || s->remote_closed) {
+                    // nobody reads it, the window goes back at once
+                    if (frame_size > 0) {
+                        window_update(0, frame_size);
+                        flush();
+                    }
+                    return http2_errc::no_error;
+                }
+                s->on_data(p, length, frame_size, (flags & http2_frame::end_stream) != 0);
+                return http2_errc::no_error;
+            }
+            case http2_frame::headers: {
+                if (id == 0) return http2_errc::protocol_error;
+                if (!unpad(flags, p, length)) return http2_errc::protocol_error;
+                if (flags & http2_frame::priority_flag) {
+                    if (length < 5) return http2_errc::protocol_error;
+                    p += 5;
+                    length -= 5;
+                }
+                block.assign(reinterpret_cast<const char*>(p), length);
+                block_end_stream = (flags & http2_frame::end_stream) != 0;
+                if (flags & http2_frame::end_headers) {
+                    return on_block(id);
+                }
+                block_stream = id;
+                return http2_errc::no_error;
+            }
+            case http2_frame::continuation: {
+                if (id == 0 || id != block_stream) return http2_errc::protocol_error;
+                // a peer sending CONTINUATION without end does not grow the block beyond the advertised limit
+                if (block.size() + length > max_header_list) return http2_errc::enhance_your_calm;
+                block.append(reinterpret_cast<const char*>(p), length);
+                if (flags & http2_frame::end_headers) {
+                    block_stream = 0;
+                    return on_block(id);
+                }
+                return http2_errc::no_error;
+            }
+            case http2_frame::rst_stream: {
+                if (id == 0 || length != 4) return http2_errc::protocol_error;
+                auto code = static_cast<http2_errc>(http2_frame::read32(p));
+                if (auto s = find(id)) {
+                    auto answered = s->remote_closed;
+                    s->local_closed = s->remote_closed = true;
+                    if (code == http2_errc::no_error && answered) {
+                        // the response is complete, the rest of the request is not needed
+                        s->outgoing.consume(s->outgoing.size());
+                        s->on_sent();
+                    }
+                    else {
+                        s->fail(code == http2_errc::no_error ? http2_errc::stream_closed : code);
+                    }
+                }
+                return http2_errc::no_error;
+            }
+            case http2_frame::settings: {
+                if (id != 0) return http2_errc::protocol_error;
+                if (flags & http2_frame::ack) return http2_errc::no_error;
+                if (length % 6 != 0) return http2_errc::frame_size_error;
+                for (size_t i = 0; i < length; i += 6) {
+                    auto key = (p[i] << 8) | p[i + 1];
+                    auto value = http2_frame::read32(p + i + 2);
+                    if (key == http2_frame::max_concurrent_streams) {
+                        peer_streams = value;
+                    }
+                    else if (key == http2_frame::initial_window_size) {
+                        if (value > 0x7fffffff) return http2_errc::flow_control_error;
+                        auto delta = static_cast<int64_t>(value) - static_cast<int64_t>(peer_window);
+                        peer_window = value;
+                        for (auto& s : streams) {
+                            if (s->id != 0) {
+                                s->window += delta;
+                                if (s->outgoing.size() > 0 && !s->queued && !s->local_closed) {
+                                    s->queued = true;
+                                    ready.push_back(s);
+                                }
+                            }
+                        }
+                    }
+                    else if (key == http2_frame::max_frame_size) {
+                        if (value < http2_frame::default_frame_size || value > 0xffffff) return http2_errc::protocol_error;
+                        peer_frame = value;
+                    }
+                }
+                http2_frame::header(output, 0, http2_frame::settings, http2_frame::ack, 0);
+                pump();
+                flush();
+                notify();
+                return http2_errc::no_error;
+            }
+            case http2_frame::ping: {
+                if (id != 0 || length != 8) return http2_errc::protocol_error;
+                if ((flags & http2_frame::ack) == 0) {
+                    http2_frame::header(output, 8, http2_frame::ping, http2_frame::ack, 0);
+                    output.append(reinterpret_cast<const char*>(p), 8);
+                    flush();
+                }
+                return http2_errc::no_error;
+            }
+            case http2_frame::goaway: {
+                if (id != 0 || length < 8) return http2_errc::protocol_error;
+                auto last = http2_frame::read32(p) & 0x7fffffff;
+                going_away = true;
+                // streams the peer did not take may be sent again on a new connection
+                auto list = streams;
+                for (auto& s : list) {
+                    if (s->id == 0 || s->id > last) {
+                        s->fail(http2_errc::refused_stream);
+                    }
+                }
+                notify();
+                return http2_errc::no_error;
+            }
+            case http2_frame::window_update: {
+                if (length != 4) return http2_errc::frame_size_error;
+                // a zero increment is a protocol error and a window past 2^31-1 a flow control error,
+                // of the connection or of the stream only (RFC 7540 section 6.9)
+                auto increment = http2_frame::read32(p) & 0x7fffffff;
+                if (id == 0) {
+                    if (increment == 0) return http2_errc::protocol_error;
+                    if (window + increment > http2_frame::max_window) return http2_errc::flow_control_error;
+                    window += increment;
+                }
+                else if (auto s = find(id)) {
+                    auto code = increment == 0 ? http2_errc::protocol_error
+                        : s->window + increment > http2_frame::max_window ? http2_errc::flow_control_error : http2_errc::no_error;
+                    if (code != http2_errc::no_error) {
+                        send_reset(*s, code);
+                        s->fail(code);
+                        return http2_errc::no_error;
+                    }
+                    s->window += increment;
+                    if ((s->outgoing.size() > 0 || s->end_pending) && !s->queued && !s->local_closed) {
+                        s->queued = true;
+                        ready.push_back(s->shared_from_this());
+                    }
+                }
+                pump();
+                flush();
+                return http2_errc::no_error;
+            }
+            case http2_frame::push_promise:
+                // push is disabled by our settings
+                return http2_errc::protocol_error;
+            default:
+                return http2_errc::no_error;
+            }
+        }
+
+        // the block is decoded even for a stream gone, the dynamic table must follow the peer
+        http2_errc on_block(uint32_t id) {
+            http2_fields fields;
+            if (!decoder.decode(reinterpret_cast<const uint8_t*>(block.data()), block.size(), fields)) {
+                return http2_errc::compression_error;
+            }
+            if (auto s = find(id)) {
+                if (!s->remote_closed) {
+                    s->on_headers(fields, block_end_stream);
+                }
+            }
+            return http2_errc::no_error;
+        }
+
+        // the owner may open more streams now, or move to a new connection
+        void notify() {
+            if (owner) {
+                auto self = this->shared_from_this();
+                asio::post(executor, [self]() {
+                    if (self->owner) {
+                        self->owner->on_session(http_error());
+                    }
+                });
+            }
+        }
+    };
+}
@@ -1,17 +1,30 @@
 #pragma once
 #include <list>
+#include <algorithm>
+#include <cctype>
+#include <cmath>
 #include <map>
+#include <unordered_map>
 #include <deque>
+#include <vector>
 #include <mutex>
 #include <string>
 #include <sstream>
 #include <chrono>
+#include <atomic>
+#include <thread>
+#include <type_traits>
+#include <boost/asio/io_context.hpp>
 #include <boost/asio/thread_pool.hpp>
 #include <boost/asio/strand.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/use_future.hpp>
 #include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/version.hpp>
 #include <boost/beast/http.hpp>
+#include <boost/beast/zlib/inflate_stream.hpp>
 
 #ifndef ASIO_POOL_HTTPS_IGNORE
 #include <boost/asio/ssl.hpp>
@@ -42,15 +55,30 @@ namespace tms {
     namespace http = beast::http;
     namespace asio = boost::asio;
 
+    // executor of the pool, chosen at compile time; a concrete one, e.g. asio::io_context::executor_type,
+    // spares the copies of the type erased executor that every socket, timer and handler of a request makes
+#ifndef ASIO_POOL_EXECUTOR
+#define ASIO_POOL_EXECUTOR asio::any_io_executor
+#endif
+
     using tcp = asio::ip::tcp;
-    using tcp_resolver = tcp::resolver;
-    using tcp_endpoints = tcp_resolver::results_type;
-    using tcp_endpoint = tcp_endpoints::endpoint_type;
-    using asio_executor = asio::any_io_executor;
+    using asio_executor = ASIO_POOL_EXECUTOR;
+    using asio_strand = asio::strand<asio_executor>;
     using http_error = beast::error_code;
     using http_string = beast::string_view;
     using http_verb = http::verb;
     using system_clock = std::chrono::system_clock;
+    using steady_clock = std::chrono::steady_clock;
+
+    // io objects of a connection run on its strand, or on the type erased executor holding it:
+    // beast 1.74 does not take a strand over a type erased executor as the stream executor
+    using asio_io_executor = std::conditional<std::is_same<asio_executor, asio::any_io_executor>::value, asio::any_io_executor, asio_strand>::type;
+    using tcp_socket = asio::basic_stream_socket<tcp, asio_io_executor>;
+    using tcp_stream = beast::basic_stream<tcp, asio_io_executor>;
+    using tcp_resolver = asio::ip::basic_resolver<tcp, asio_io_executor>;
+    using tcp_endpoints = tcp_resolver::results_type;
+    using tcp_endpoint = tcp_endpoints::endpoint_type;
+    using asio_timer = asio::basic_waitable_timer<steady_clock, asio::wait_traits<steady_clock>, asio_io_executor>;
 
 #ifndef ASIO_POOL_HTTPS_IGNORE
     using https_method = asio::ssl::context::method;
@@ -89,4 +117,227 @@ namespace tms {
         http_stage_read = 5,
         http_stage_complete = 6
     };
+
+    // pool errors, requests failed by the pool itself and not by the network
+    enum class http_pool_errc {
+        queue_full = 1,
+        dropped = 2,
+        circuit_open = 3
+    };
+
+    class http_pool_category_t : public boost::system::error_category {
+    public:
+        virtual const char* name() const noexcept {
+            return "http_pool";
+        }
+        virtual std::string message(int ev) const {
+            switch (static_cast<http_pool_errc>(ev)) {
+            case http_pool_errc::queue_full: return "request queue is full";
+            case http_pool_errc::dropped: return "request dropped from full queue";
+            case http_pool_errc::circuit_open: return "circuit breaker of the host is open";
+            }
+            return "http pool error";
+        }
+    };
+
+    inline const boost::system::error_category& http_pool_category() {
+        static http_pool_category_t category;
+        return category;
+    }
+
+    inline http_error make_error_code(http_pool_errc e) {
+        return http_error(static_cast<int>(e), http_pool_category());
+    }
+
+    // http/2 error codes of RST_STREAM and GOAWAY frames (RFC 7540 section 7)
+    enum class http2_errc {
+        no_error = 0,
+        protocol_error = 1,
+        internal_error = 2,
+        flow_control_error = 3,
+        settings_timeout = 4,
+        stream_closed = 5,
+        frame_size_error = 6,
+        refused_stream = 7,
+        cancel = 8,
+        compression_error = 9,
+        connect_error = 10,
+        enhance_your_calm = 11,
+        inadequate_security = 12,
+        http_1_1_required = 13
+    };
+
+    class http2_category_t : public boost::system::error_category {
+    public:
+        virtual const char* name() const noexcept {
+            return "http2";
+        }
+        virtual std::string message(int ev) const {
+            switch (static_cast<http2_errc>(ev)) {
+            case http2_errc::no_error: return "no error";
+            case http2_errc::protocol_error: return "http/2 protocol error";
+            case http2_errc::internal_error: return "http/2 internal error";
+            case http2_errc::flow_control_error: return "http/2 flow control error";
+            case http2_errc::settings_timeout: return "http/2 settings timeout";
+            case http2_errc::stream_closed: return "http/2 stream closed";
+            case http2_errc::frame_size_error: return "http/2 frame size error";
+            case http2_errc::refused_stream: return "http/2 stream refused";
+            case http2_errc::cancel: return "http/2 stream cancelled";
+            case http2_errc::compression_error: return "http/2 header compression error";
+            case http2_errc::connect_error: return "http/2 connect error";
+            case http2_errc::enhance_your_calm: return "http/2 enhance your calm";
+            case http2_errc::inadequate_security: return "http/2 inadequate security";
+            case http2_errc::http_1_1_required: return "http/1.1 required";
+            }
+            return "http/2 error";
+        }
+    };
+
+    inline const boost::system::error_category& http2_category() {
+        static http2_category_t category;
+        return category;
+    }
+
+    inline http_error make_error_code(http2_errc e) {
+        return http_error(static_cast<int>(e), http2_category());
+    }
+
+    //---------------------------------------------------------------------------------------------
+    // small blocks recycled through per thread free lists of 64 byte size classes,
+    // a block released on another thread joins the list of that thread
+
+    class http_recycling_cache {
+    public:
+        static void* allocate(size_t size) {
+            auto index = size_class(size);
+            if (index < class_count && !destroyed()) {
+                auto& cache = instance();
+                if (auto block = cache.lists[index]) {
+                    cache.lists[index] = block->next;
+                    cache.counts[index]--;
+                    return block;
+                }
+                return ::operator new((index + 1) * class_size);
+            }
+            return ::operator new(size);
+        }
+
+        static void deallocate(void* ptr, size_t size) {
+            auto index = size_class(size);
+            if (index < class_count && !destroyed()) {
+                auto& cache = instance();
+                if (cache.counts[index] < class_depth) {
+                    auto block = static_cast<free_block*>(ptr);
+                    block->next = cache.lists[index];
+                    cache.lists[index] = block;
+                    cache.counts[index]++;
+                    return;
+                }
+            }
+            ::operator delete(ptr);
+        }
+
+    private:
+        static const size_t class_size = 64;
+        static const size_t class_count = 32;
+        static const size_t class_depth = 32;
+
+        struct free_block {
+            free_block* next;
+        };
+
+        free_block* lists[class_count] = {};
+        size_t counts[class_count] = {};
+
+        ~http_recycling_cache() {
+            destroyed() = true;
+            for (auto block : lists) {
+                while (block) {
+                    auto next = block->next;
+                    ::operator delete(block);
+                    block = next;
+                }
+            }
+        }
+
+        static size_t size_class(size_t size) {
+            return size ? (size - 1) / class_size : 0;
+        }
+
+        // blocks released by thread_local destructors after the cache itself go to the heap
+        static bool& destroyed() {
+            static thread_local bool value = false;
+            return value;
+        }
+
+        static http_recycling_cache& instance() {
+            static thread_local http_recycling_cache cache;
+            return cache;
+        }
+    };
+
+    template<typename T>
+    class http_recycling_allocator {
+    public:
+        typedef T value_type;
+
+        template<typename U>
+        struct rebind {
+            typedef http_recycling_allocator<U> other;
+        };
+
+        http_recycling_allocator() noexcept {}
+
+        template<typename U>
+        http_recycling_allocator(const http_recycling_allocator<U>&) noexcept {}
+
+        T* allocate(size_t n) {
+            return static_cast<T*>(http_recycling_cache::allocate(n * sizeof(T)));
+        }
+
+        void deallocate(T* ptr, size_t n) {
+            http_recycling_cache::deallocate(ptr, n * sizeof(T));
+        }
+
+        template<typename U>
+        bool operator==(const http_recycling_allocator<U>&) const noexcept { return true; }
+
+        template<typename U>
+        bool operator!=(const http_recycling_allocator<U>&) const noexcept { return false; }
+    };
+
+    // function posted with the recycling allocator: without an allocator of its own a posted function takes
+    // the single block asio keeps per thread, and the strand of the client then allocates for its own operations
+    template<typename function_type>
+    class http_recycled_function {
+    public:
+        typedef http_recycling_allocator<void> allocator_type;
+
+        explicit http_recycled_function(function_type f)
+            : function(std::move(f))
+        {}
+
+        void operator()() {
+            function();
+        }
+
+        allocator_type get_allocator() const noexcept {
+            return allocator_type();
+        }
+
+    private:
+        function_type function;
+    };
+
+    template<typename function_type>
+    http_recycled_function<typename std::decay<function_type>::type> http_recycled(function_type&& f) {
+        return http_recycled_function<typename std::decay<function_type>::type>(std::forward<function_type>(f));
+    }
+}
+
+namespace boost {
+    namespace system {
+        template<> struct is_error_code_enum<tms::http_pool_errc> : std::true_type {};
+        template<> struct is_error_code_enum<tms::http2_errc> : std::true_type {};
+    }
 }
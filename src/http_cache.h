@@ -0,0 +1,388 @@
+#pragma once
+#include "http_base.h"
+#include "http_request.h"
+
+namespace tms {
+
+    // HTTP-date of IMF-fixdate form, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+    inline bool http_parse_date(http_string value, system_clock::time_point& time) {
+        static const char* months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+        if (value.size() != 29 || value[3] != ',' || value.substr(26) != "GMT") {
+            return false;
+        }
+        auto number = [&value](size_t pos, size_t len) {
+            int result = 0;
+            for (size_t i = pos; i < pos + len; i++) {
+                if (!std::isdigit(static_cast<unsigned char>(value[i]))) return -1;
+                result = result * 10 + (value[i] - '0');
+            }
+            return result;
+        };
+        int month = 0;
+        while (month < 12 && value.substr(8, 3) != months[month]) month++;
+        int day = number(5, 2), year = number(12, 4), hour = number(17, 2), minute = number(20, 2), second = number(23, 2);
+        if (month == 12 || day < 1 || year < 0 || hour < 0 || minute < 0 || second < 0) {
+            return false;
+        }
+
+        // days since 1970-01-01 of the civil date
+        int y = year - (month < 2 ? 1 : 0);
+        int era = y / 400;
+        int yoe = y - era * 400;
+        int doy = (153 * (month + (month < 2 ? 10 : -2)) + 2) / 5 + day - 1;
+        int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        int64_t days = static_cast<int64_t>(era) * 146097 + doe - 719468;
+        time = system_clock::time_point(std::chrono::duration_cast<system_clock::duration>(std::chrono::seconds(days * 86400 + hour * 3600 + minute * 60 + second)));
+        return true;
+    }
+
+    struct http_cache_stats {
+        size_t hits = 0;                // fresh responses served without a connection
+        size_t misses = 0;              // sent to the host, revalidations included
+        size_t revalidated = 0;         // 304 responses completed with the cached body
+        size_t stored = 0;
+        size_t evicted = 0;
+        size_t entries = 0;
+        size_t bytes = 0;
+    };
+
+    //---------------------------------------------------------------------------------------------
+    // GET responses of the pool kept in memory by url while Cache-Control or Expires let them (private cache),
+    // stale ones with ETag or Last-Modified are revalidated by a conditional request, least recently used go
+    // first over the byte budget; a successful unsafe request (POST, PUT, DELETE, PATCH) drops its url
+
+    class http_response_cache : public std::enable_shared_from_this<http_response_cache> {
+    public:
+        // 0 disables the cache and drops its entries
+        void set_budget(size_t bytes) {
+            std::lock_guard<std::mutex> lock(mutex);
+            budget = bytes;
+            shrink();
+        }
+
+        bool enabled() {
+            return budget_set.load(std::memory_order_relaxed);
+        }
+
+        // a fresh response completes the request on the executor, true then; otherwise the request is sent
+        // with the cache waiting for its response, conditional one if there is a stale response to revalidate;
+        // an unsafe method waits for its response too, a success invalidates the url (RFC 7234 4.4)
+        bool lookup(std::string key, const http_request_ptr& req, const asio_executor& executor) {
+            if (req->cache_link) {
+                return false;
+            }
+            if (!safe(req->method())) {
+                req->cache_link = std::make_shared<request_link>(shared_from_this(), std::move(key), true);
+                return false;
+            }
+            if (req->method() != http_verb::get || !req->cacheable()) {
+                return false;
+            }
+
+            // the caller's own conditions and ranges go as is
+            auto control = req->request_field("cache-control");
+            if (has_directive(control, "no-store") || !req->request_field("if-none-match").empty() || !req->request_field("if-modified-since").empty() || !req->request_field("range").empty()) {
+                return false;
+            }
+
+            entry_ptr stale;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto ptr = entries.find(key);
+                if (ptr != entries.end() && matches(*ptr->second, *req)) {
+                    auto entry = ptr->second;
+                    if (steady_clock::now() < entry->fresh_until && !has_directive(control, "no-cache") && directive_seconds(control, "max-age") != 0) {
+                        touch(*entry);
+                        counters.hits++;
+                        asio::post(executor, [req, entry]() {
+                            req->load_response(entry->response);
+                            req->end(http_error(), http_stage_complete);
+                        });
+                        return true;
+                    }
+                    stale = entry;
+                }
+                counters.misses++;
+            }
+
+            auto link = std::make_shared<request_link>(shared_from_this(), std::move(key));
+            if (stale) {
+                auto& header = stale->response.header;
+                auto etag = header[http::field::etag];
+                auto modified = header[http::field::last_modified];
+                if (!etag.empty()) {
+                    req->set("if-none-match", etag);
+                }
+                if (!modified.empty()) {
+                    req->set("if-modified-since", modified);
+                }
+                if (!etag.empty() || !modified.empty()) {
+                    link->stale = std::move(stale);
+                }
+            }
+            req->cache_link = std::move(link);
+            return false;
+        }
+
+        void clear() {
+            std::lock_guard<std::mutex> lock(mutex);
+            entries.clear();
+            order.clear();
+            used = 0;
+        }
+
+        http_cache_stats get_stats(bool reset) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto result = counters;
+            result.entries = entries.size();
+            result.bytes = used;
+            if (reset) {
+                counters = http_cache_stats();
+            }
+            return result;
+        }
+
+    private:
+        struct entry_type {
+            std::string key;
+            http_cached_response response;
+            std::vector<std::pair<std::string, std::string> > vary;     // request fields the response varies by
+            steady_clock::time_point fresh_until;
+            size_t size = 0;
+            std::list<entry_type*>::iterator position;
+        };
+
+        typedef std::shared_ptr<entry_type> entry_ptr;
+
+        // a response of the request for the cache, the stale entry is kept for a 304 even if it is evicted meanwhile
+        class request_link : public http_cache_link {
+        public:
+            request_link(std::shared_ptr<http_response_cache> c, std::string k, bool _invalidate = false)
+                : cache(std::move(c)), key(std::move(k)), invalidate(_invalidate)
+            {}
+
+            virtual void on_response(http_request& req, http_error err) {
+                if (err) return;
+                auto status = req.status();
+                if (invalidate) {
+                    if (status >= 200 && status < 400) {
+                        cache->erase(key);
+                    }
+                }
+                else if (status == 304 && stale) {
+                    cache->revalidate(key, req, *stale);
+                }
+                else if (status == 200) {
+                    cache->store(key, req);
+                }
+            }
+
+            std::shared_ptr<http_response_cache> cache;
+            std::string key;
+            entry_ptr stale;
+            bool invalidate;
+        };
+
+        std::mutex mutex;
+        size_t budget = 0;
+        std::atomic<bool> budget_set{ false };
+        size_t used = 0;
+        std::unordered_map<std::string, entry_ptr> entries;
+        std::list<entry_type*> order;       // most recently used first
+        http_cache_stats counters;
+
+        // comma separated list items without spaces around them
+        template<typename visitor_type>
+        static bool find_item(http_string value, visitor_type&& visitor) {
+            while (!value.empty()) {
+                auto pos = value.find(',');
+                auto item = value.substr(0, pos);
+                value = pos == http_string::npos ? http_string() : value.substr(pos + 1);
+                while (!item.empty() && (item.front() == ' ' || item.front() == '\t')) item.remove_prefix(1);
+                while (!item.empty() && (item.back() == ' ' || item.back() == '\t')) item.remove_suffix(1);
+                if (!item.empty() && visitor(item)) return true;
+            }
+            return false;
+        }
+
+        // methods that leave the resource as is
+        static bool safe(http_verb method) {
+            return method == http_verb::get || method == http_verb::head || method == http_verb::options || method == http_verb::trace;
+        }
+
+        static bool has_directive(http_string value, http_string name) {
+            return find_item(value, [&name](http_string item) {
+                return beast::iequals(item, name);
+            });
+        }
+
+        // delta-seconds, -1 if invalid
+        static int64_t parse_seconds(http_string value) {
+            if (value.size() > 1 && value.front() == '"' && value.back() == '"') {
+                value = value.substr(1, value.size() - 2);
+            }
+            if (value.empty()) return -1;
+            int64_t result = 0;
+            for (auto c : value) {
+                if (!std::isdigit(static_cast<unsigned char>(c))) return -1;
+                result = std::min<int64_t>(result * 10 + (c - '0'), int64_t(1) << 31);
+            }
+            return result;
+        }
+
+        // seconds of a directive like max-age=60, -1 without it
+        static int64_t directive_seconds(http_string value, http_string name) {
+            int64_t result = -1;
+            find_item(value, [&name, &result](http_string item) {
+                if (item.size() <= name.size() || item[name.size()] != '=' || !beast::iequals(item.substr(0, name.size()), name)) {
+                    return false;
+                }
+                result = parse_seconds(item.substr(name.size() + 1));
+                return true;
+            });
+            return result;
+        }
+
+        static bool matches(const entry_type& entry, http_request& req) {
+            for (auto& field : entry.vary) {
+                if (req.request_field(field.first) != field.second) return false;
+            }
+            return true;
+        }
+
+        void store(const std::string& key, http_request& req) {
+            auto entry = std::make_shared<entry_type>();
+            if (!req.save_response(entry->response)) {
+                return;
+            }
+            auto& header = entry->response.header;
+            if (has_directive(header[http::field::cache_control], "no-store")) {
+                return erase(key);
+            }
+            auto varies = find_item(header[http::field::vary], [&entry, &req](http_string name) {
+                if (name == "*") return true;
+                entry->vary.emplace_back(std::string(name), std::string(req.request_field(name)));
+                return false;
+            });
+            if (varies) {
+                return erase(key);
+            }
+            insert(key, std::move(entry));
+        }
+
+        // 304 refreshes the stored header fields and the response gets the cached body
+        void revalidate(const std::string& key, http_request& req, const entry_type& stale) {
+            auto entry = std::make_shared<entry_type>();
+            if (!req.save_response(entry->response)) {
+                return;
+            }
+            auto fresh = std::move(entry->response.header);
+            entry->response = stale.response;
+            entry->vary = stale.vary;
+            auto& header = entry->response.header;
+            for (auto& field : fresh) {
+                auto name = field.name();
+                if (name == http::field::content_length || name == http::field::transfer_encoding || name == http::field::connection || name == http::field::keep_alive) {
+                    continue;
+                }
+                header.set(field.name_string(), field.value());
+            }
+            req.load_response(entry->response);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                counters.revalidated++;
+            }
+            if (has_directive(header[http::field::cache_control], "no-store")) {
+                return erase(key);
+            }
+            insert(key, std::move(entry));
+        }
+
+        // freshness lifetime by max-age, Expires or a tenth of the time since Last-Modified, less the age;
+        // a response neither fresh nor revalidable is not kept
+        void insert(const std::string& key, entry_ptr entry) {
+            auto& header = entry->response.header;
+            auto now = system_clock::now();
+            system_clock::time_point date = now, time;
+            if (http_parse_date(header[http::field::date], time)) {
+                date = time;
+            }
+            auto age = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::seconds>(now - date).count());
+            age = std::max(age, parse_seconds(header[http::field::age]));
+
+            auto control = header[http::field::cache_control];
+            int64_t lifetime = 0;
+            if (!has_directive(control, "no-cache")) {
+                auto max_age = directive_seconds(control, "max-age");
+                auto expires = header[http::field::expires];
+                if (max_age >= 0) {
+                    lifetime = max_age;
+                }
+                else if (!expires.empty()) {
+                    // invalid Expires like "0" means already expired
+                    if (http_parse_date(expires, time)) {
+                        lifetime = std::chrono::duration_cast<std::chrono::seconds>(time - date).count();
+                    }
+                }
+                else if (http_parse_date(header[http::field::last_modified], time) && time < date) {
+                    lifetime = std::chrono::duration_cast<std::chrono::seconds>(date - time).count() / 10;
+                }
+            }
+            auto revalidable = !header[http::field::etag].empty() || !header[http::field::last_modified].empty();
+            if (lifetime <= age && !revalidable) {
+                return erase(key);
+            }
+            entry->fresh_until = steady_clock::now() + std::chrono::seconds(std::max<int64_t>(lifetime - age, 0));
+
+            entry->key = key;
+            entry->size = sizeof(entry_type) + key.size() * 2 + entry->response.body.size();
+            for (auto& field : header) {
+                entry->size += field.name_string().size() + field.value().size() + 4;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (entry->size > budget) {
+                remove(key);
+                return;
+            }
+            remove(key);
+            order.push_front(entry.get());
+            entry->position = order.begin();
+            used += entry->size;
+            entries.emplace(key, std::move(entry));
+            counters.stored++;
+            shrink();
+        }
+
+        void erase(const std::string& key) {
+            std::lock_guard<std::mutex> lock(mutex);
+            remove(key);
+        }
+
+        // mutex must be locked
+        void remove(const std::string& key) {
+            auto ptr = entries.find(key);
+            if (ptr == entries.end()) return;
+            used -= ptr->second->size;
+            order.erase(ptr->second->position);
+            entries.erase(ptr);
+        }
+
+        // mutex must be locked
+        void touch(entry_type& entry) {
+            order.splice(order.begin(), order, entry.position);
+        }
+
+        // least recently used entries over the budget go, mutex must be locked
+        void shrink() {
+            budget_set.store(budget > 0, std::memory_order_relaxed);
+            while (used > budget && !order.empty()) {
+                auto key = order.back()->key;
+                remove(key);
+                counters.evicted++;
+            }
+        }
+    };
+
+    typedef std::shared_ptr<http_response_cache> http_response_cache_ptr;
+}
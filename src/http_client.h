@@ -1,6 +1,7 @@
 #pragma once
 #include "http_base.h"
 #include "http_request.h"
+#include "http2.h"
 #include "http_utils.h"
 
 namespace tms {
@@ -20,14 +21,147 @@ namespace tms {
         static int read;
         static int keep;
         static int stats;
+        static int dns_ttl;
+        static int dns_fail_ttl;
+        static int warm_retry;
     };
     template<typename T> int http_timeouts_t<T>::connect = 30;
     template<typename T> int http_timeouts_t<T>::write = 30;
     template<typename T> int http_timeouts_t<T>::read = 60;
     template<typename T> int http_timeouts_t<T>::keep = 60;
     template<typename T> int http_timeouts_t<T>::stats = 30;
+    template<typename T> int http_timeouts_t<T>::dns_ttl = 60;
+    template<typename T> int http_timeouts_t<T>::dns_fail_ttl = 5;
+    template<typename T> int http_timeouts_t<T>::warm_retry = 5;
     using http_timeouts = http_timeouts_t<>;
 
+    //---------------------------------------------------------------------------------------------
+    // shared dns cache: keeps resolved endpoints (and failures) per host:port for a while
+    // and joins concurrent lookups of the same key into the single resolver request
+
+    class http_resolver_cache :
+        public std::enable_shared_from_this<http_resolver_cache>
+    {
+    public:
+        typedef std::function<void(http_error, tcp_endpoints)> handler_type;
+
+        explicit http_resolver_cache(const asio_executor& ex)
+            : executor(ex)
+        {}
+
+        void async_resolve(const std::string& host, const std::string& port, const asio_strand& ex, handler_type handler) {
+            std::string key(host);
+            key += ":";
+            key += port;
+
+            std::shared_ptr<tcp_resolver> resolver;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto now = steady_clock::now();
+                auto ptr = entries.find(key);
+                if (ptr == entries.end()) {
+                    purge(now);
+                    ptr = entries.emplace(key, entry()).first;
+                }
+                auto& ent = ptr->second;
+
+                // lookup in progress, wait for it
+                if (ent.resolver) {
+                    ent.waiters.emplace_back(ex, std::move(handler));
+                    return;
+                }
+
+                // fresh result (or recent failure)
+                if (ent.expires > now) {
+                    asio::post(ex, std::bind(std::move(handler), ent.err, ent.endpoints));
+                    return;
+                }
+
+                resolver = std::make_shared<tcp_resolver>(asio::make_strand(executor));
+                ent.resolver = resolver;
+                ent.waiters.emplace_back(ex, std::move(handler));
+            }
+
+            auto self = shared_from_this();
+            resolver->async_resolve(host, port, [self, key, resolver](http_error err, tcp_endpoints endpoints) {
+                self->on_resolve(key, err, std::move(endpoints));
+            });
+        }
+
+        // endpoint that won the last connect race to the host, tried first next time
+        void prefer(const std::string& host, const std::string& port, const tcp_endpoint& endpoint) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto ptr = entries.find(host + ":" + port);
+            if (ptr != entries.end()) {
+                ptr->second.preferred = endpoint;
+            }
+        }
+
+        tcp_endpoint preferred(const std::string& host, const std::string& port) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto ptr = entries.find(host + ":" + port);
+            return ptr != entries.end() ? ptr->second.preferred : tcp_endpoint();
+        }
+
+        void clear() {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto ptr = entries.begin(); ptr != entries.end();) {
+                if (ptr->second.resolver) (ptr++)->second.expires = {};
+                else ptr = entries.erase(ptr);
+            }
+        }
+
+    private:
+        struct entry {
+            steady_clock::time_point expires;
+            http_error err;
+            tcp_endpoints endpoints;
+            tcp_endpoint preferred;
+            std::shared_ptr<tcp_resolver> resolver;
+            std::vector<std::pair<asio_strand, handler_type> > waiters;
+        };
+
+        asio_executor executor;
+        std::mutex mutex;
+        std::map<std::string, entry> entries;
+        steady_clock::time_point purged = steady_clock::now();
+
+        void on_resolve(const std::string& key, http_error err, tcp_endpoints endpoints) {
+            decltype(entry::waiters) waiters;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto ptr = entries.find(key);
+                if (ptr == entries.end()) return;
+                auto& ent = ptr->second;
+                ent.resolver.reset();
+                waiters.swap(ent.waiters);
+
+                // do not keep aborted lookups, next caller tries again
+                if (err != asio::error::operation_aborted) {
+                    auto ttl = err ? http_timeouts::dns_fail_ttl : http_timeouts::dns_ttl;
+                    ent.expires = steady_clock::now() + std::chrono::seconds(ttl);
+                    ent.err = err;
+                    ent.endpoints = endpoints;
+                }
+            }
+            for (auto& waiter : waiters) {
+                asio::post(waiter.first, std::bind(std::move(waiter.second), err, endpoints));
+            }
+        }
+
+        // drop expired entries, at most once per dns_ttl
+        void purge(steady_clock::time_point now) {
+            if (now - purged < std::chrono::seconds(http_timeouts::dns_ttl)) return;
+            purged = now;
+            for (auto ptr = entries.begin(); ptr != entries.end();) {
+                if (!ptr->second.resolver && ptr->second.expires <= now) ptr = entries.erase(ptr);
+                else ++ptr;
+            }
+        }
+    };
+
+    typedef std::shared_ptr<http_resolver_cache> http_resolver_cache_ptr;
+
     struct http_client_stats {
         int state = 0;
         size_t queue_size = 0;
@@ -35,87 +169,1023 @@ namespace tms {
         size_t total_requests = 0;
         size_t bytes_written = 0;
         size_t bytes_readed = 0;
+        size_t bytes_decoded = 0;       // read with decoded body sizes of compressed responses
+        size_t handshake_count = 0;
+        size_t handshake_resumed = 0;
+        size_t dropped_count = 0;
         double total_seconds = 0;
     };
 
-    class http_client :
-        public std::enable_shared_from_this<http_client>
-    {
+    // request latency stages, queue is the time from enqueue till the first write,
+    // first_byte from the request written till the response header, read the rest of response
+    enum http_timing {
+        http_timing_queue = 0,
+        http_timing_resolve = 1,
+        http_timing_connect = 2,
+        http_timing_handshake = 3,
+        http_timing_write = 4,
+        http_timing_first_byte = 5,
+        http_timing_read = 6,
+        http_timing_total = 7,
+        http_timing_count = 8
+    };
+
+    struct http_latency_stats {
+        latency_snapshot timings[http_timing_count];
+
+        void merge(const http_latency_stats& other) {
+            for (size_t i = 0; i < http_timing_count; i++) {
+                timings[i].merge(other.timings[i]);
+            }
+        }
+
+        // seconds, e.g. percentile(http_timing_total, 0.999)
+        double percentile(http_timing timing, double q) const {
+            return timings[timing].percentile(q);
+        }
+    };
+
+    // monotonic counters of a host, never reset
+    struct http_counters_stats {
+        size_t requests = 0;
+        size_t errors[http_stage_complete] = {};    // failed requests by stage, none is failed by the pool itself
+        size_t statuses[5] = {};                    // responses by status class, 1xx .. 5xx
+        size_t bytes_written = 0;
+        size_t bytes_readed = 0;
+        size_t bytes_decoded = 0;
+        size_t connects = 0;
+        size_t retries = 0;
+        size_t rejected = 0;
+        size_t dropped = 0;
+    };
+
+    // latency histograms and counters of a host, recorded by its connections without locks
+    class http_host_metrics {
     public:
-        
-        explicit http_client(const asio_executor& ex, http_string _host, http_string _port)
-            : executor(ex), resolver(ex), timer(ex), host(_host), port(_port)
+        void record(http_timing timing, steady_clock::duration d) {
+            histograms[timing].record(d);
+        }
+
+        void complete(http_error err, http_stage stage, unsigned status) {
+            requests.fetch_add(1, std::memory_order_relaxed);
+            if (err) {
+                errors[stage < http_stage_complete ? stage : http_stage_none].fetch_add(1, std::memory_order_relaxed);
+            }
+            else if (status >= 100 && status < 600) {
+                statuses[status / 100 - 1].fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        std::atomic<size_t> bytes_written{ 0 };
+        std::atomic<size_t> bytes_readed{ 0 };
+        std::atomic<size_t> bytes_decoded{ 0 };
+        std::atomic<size_t> connects{ 0 };
+        std::atomic<size_t> retries{ 0 };
+        std::atomic<size_t> rejected{ 0 };
+        std::atomic<size_t> dropped{ 0 };
+
+        // latency since the previous reset, counters since start
+        void snapshot(http_latency_stats& latency, http_counters_stats& counters, bool reset) {
+            for (size_t i = 0; i < http_timing_count; i++) {
+                histograms[i].snapshot(latency.timings[i], reset);
+            }
+            counters.requests = requests.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < http_stage_complete; i++) {
+                counters.errors[i] = errors[i].load(std::memory_order_relaxed);
+            }
+            for (size_t i = 0; i < 5; i++) {
+                counters.statuses[i] = statuses[i].load(std::memory_order_relaxed);
+            }
+            counters.bytes_written = bytes_written.load(std::memory_order_relaxed);
+            counters.bytes_readed = bytes_readed.load(std::memory_order_relaxed);
+            counters.bytes_decoded = bytes_decoded.load(std::memory_order_relaxed);
+            counters.connects = connects.load(std::memory_order_relaxed);
+            counters.retries = retries.load(std::memory_order_relaxed);
+            counters.rejected = rejected.load(std::memory_order_relaxed);
+            counters.dropped = dropped.load(std::memory_order_relaxed);
+        }
+
+    private:
+        latency_histogram histograms[http_timing_count];
+        std::atomic<size_t> requests{ 0 };
+        std::atomic<size_t> errors[http_stage_complete] = {};
+        std::atomic<size_t> statuses[5] = {};
+    };
+
+    typedef std::shared_ptr<http_host_metrics> http_host_metrics_ptr;
+
+    //---------------------------------------------------------------------------------------------
+    // circuit breaker of a host: failures in a row at any stage, or the error rate of a window of requests,
+    // open it, new connections are refused for open_time, then a single probe decides to close or open it again;
+    // failures are network errors and 5xx responses, cancelled requests and pool errors do not count
+
+    enum http_circuit_state {
+        http_circuit_closed = 0,
+        http_circuit_open = 1,
+        http_circuit_half_open = 2
+    };
+
+    struct http_circuit_config {
+        size_t failures = 0;            // in a row at the same stage, 0 disables the breaker
+        double error_rate = 0;          // of the last window requests, 0 is unused
+        size_t window = 20;
+        steady_clock::duration open_time = std::chrono::seconds(10);
+    };
+
+    class http_circuit_breaker {
+    public:
+        enum permit {
+            permit_denied = 0,
+            permit_granted = 1,
+            permit_probe = 2,
+            permit_wait = 3             // the probe is on the way
+        };
+
+        explicit http_circuit_breaker(const http_circuit_config& _config = http_circuit_config())
+            : config(_config)
         {}
 
-#ifndef ASIO_POOL_HTTPS_IGNORE
-        explicit http_client(const asio_executor& ex, http_string _host, http_string _port, https_method _method)
-            : executor(ex), resolver(ex), timer(ex), host(_host), port(_port)
-        {
-            stream.configure(_method);
-            hostname = host;
-            if (!port.empty()) {
-                hostname += ":";
-                hostname += port;
+        void configure(const http_circuit_config& value) {
+            std::lock_guard<std::mutex> lock(mutex);
+            config = value;
+            if (config.failures == 0) {
+                close();
             }
         }
-#endif
+
+        // new connection of the host, the probe is granted again if the previous one gave no answer in open_time
+        permit allow() {
+            if (current.load(std::memory_order_relaxed) == http_circuit_closed) {
+                return permit_granted;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            auto now = steady_clock::now();
+            if (current == http_circuit_closed) {
+                return permit_granted;
+            }
+            if (now < until) {
+                return current == http_circuit_open ? permit_denied : permit_wait;
+            }
+            current = http_circuit_half_open;
+            until = now + config.open_time;
+            return permit_probe;
+        }
+
+        // requests fail at once while open, they wait for the probe while half open
+        bool is_open() {
+            if (current.load(std::memory_order_relaxed) != http_circuit_open) {
+                return false;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            return current == http_circuit_open && steady_clock::now() < until;
+        }
+
+        void record(http_error err, http_stage stage, unsigned status) {
+            auto failed = err ? (err != asio::error::operation_aborted && err.category() != http_pool_category()) : status >= 500;
+            if (!failed && err) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (config.failures == 0) {
+                return;
+            }
+            total++;
+            if (!failed) {
+                if (current != http_circuit_closed) {
+                    close();
+                }
+                std::fill(std::begin(in_row), std::end(in_row), 0);
+            }
+            else {
+                errors++;
+                auto& count = in_row[stage < http_stage_complete ? stage : http_stage_read];
+                count++;
+                if (current == http_circuit_half_open || count >= config.failures ||
+                    (config.error_rate > 0 && total >= config.window && errors >= config.error_rate * total)) {
+                    open();
+                }
+            }
+            if (total >= config.window) {
+                total = errors = 0;
+            }
+        }
+
+        // the probe left without an answer (cancelled, expired, its connection reset), the next one goes at once
+        void abandon() {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (current == http_circuit_half_open) {
+                until = steady_clock::now();
+            }
+        }
+
+        http_circuit_state state() {
+            return current.load(std::memory_order_relaxed);
+        }
+
+        size_t opened_count() {
+            return opened.load(std::memory_order_relaxed);
+        }
+
+    private:
+        std::mutex mutex;
+        http_circuit_config config;
+        std::atomic<http_circuit_state> current{ http_circuit_closed };
+        std::atomic<size_t> opened{ 0 };
+        steady_clock::time_point until;
+        size_t in_row[http_stage_complete] = {};
+        size_t total = 0;
+        size_t errors = 0;
+
+        // must be locked
+        void open() {
+            if (current != http_circuit_open) {
+                opened.fetch_add(1, std::memory_order_relaxed);
+            }
+            current = http_circuit_open;
+            until = steady_clock::now() + config.open_time;
+            std::fill(std::begin(in_row), std::end(in_row), 0);
+            total = errors = 0;
+        }
+
+        void close() {
+            current = http_circuit_closed;
+            std::fill(std::begin(in_row), std::end(in_row), 0);
+            total = errors = 0;
+        }
+    };
+
+    typedef std::shared_ptr<http_circuit_breaker> http_circuit_breaker_ptr;
+
+    //---------------------------------------------------------------------------------------------
+    // queued requests counter with optional limit (0 is unlimited), shared by the pool and its clients,
+    // waiters are retried on every release till they return true (queued)
+
+    class http_queue_gate {
+    public:
+        typedef std::function<bool()> waiter_type;
+
+        explicit http_queue_gate(size_t _limit = 0)
+            : limit(_limit)
+        {}
+
+        bool try_acquire() {
+            auto count = queued.load(std::memory_order_relaxed);
+            do {
+                auto max = limit.load(std::memory_order_relaxed);
+                if (max > 0 && count >= max) return false;
+            } while (!queued.compare_exchange_weak(count, count + 1, std::memory_order_relaxed));
+            return true;
+        }
+
+        // the limit allows one more, taken by acquire() while the caller keeps other acquirers out
+        bool has_room() {
+            auto max = limit.load(std::memory_order_relaxed);
+            return max == 0 || queued.load(std::memory_order_relaxed) < max;
+        }
+
+        // over the limit, e.g. in place of dropped one
+        void acquire() {
+            queued.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void release(size_t count = 1) {
+            queued.fetch_sub(count, std::memory_order_relaxed);
+            if (waiting.load(std::memory_order_relaxed) > 0) {
+                notify();
+            }
+        }
+
+        void wait(waiter_type waiter) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                waiters.push_back(std::move(waiter));
+                waiting++;
+            }
+            // capacity may be freed just before
+            notify();
+        }
+
+        // waiters run outside of the lock and must not be called under any lock a waiter takes;
+        // a release arriving meanwhile makes the running pass repeat, a waiter's failed attempt releases nothing
+        void notify() {
+            if (waiting.load(std::memory_order_relaxed) == 0) {
+                return;
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            if (notifying) {
+                repeat = true;
+                return;
+            }
+            notifying = true;
+            do {
+                repeat = false;
+                std::list<waiter_type> list;
+                list.swap(waiters);
+                lock.unlock();
+                for (auto ptr = list.begin(); ptr != list.end();) {
+                    if ((*ptr)()) {
+                        ptr = list.erase(ptr);
+                        waiting--;
+                    }
+                    else ++ptr;
+                }
+                lock.lock();
+                waiters.splice(waiters.begin(), list);
+            } while (repeat);
+            notifying = false;
+        }
+
+        size_t size() {
+            return queued.load(std::memory_order_relaxed);
+        }
+
+        size_t waiting_count() {
+            return waiting.load(std::memory_order_relaxed);
+        }
+
+        std::atomic<size_t> limit;
+
+    private:
+        std::atomic<size_t> queued{ 0 };
+        std::atomic<size_t> waiting{ 0 };
+        std::mutex mutex;
+        std::list<waiter_type> waiters;
+        bool notifying = false;
+        bool repeat = false;
+    };
+
+    typedef std::shared_ptr<http_queue_gate> http_queue_gate_ptr;
+
+    class http_connection_gate;
+    typedef std::shared_ptr<http_connection_gate> http_connection_gate_ptr;
+
+    class http_host_queue;
+    typedef std::shared_ptr<http_host_queue> http_host_queue_ptr;
+
+    //---------------------------------------------------------------------------------------------
+    // connection as seen by the pool, basic_http_client implements it for the given stream type
+
+    class http_client : public http_process_target {
+    public:
+        virtual ~http_client() {}
 
         template<typename Request>
         inline void enqueue(Request*&& req) {
             enqueue(http_request_ptr(std::move(req)));
         }
 
-        inline void enqueue(http_request_ptr req) {
-            asio::post(executor, std::bind(&http_client::append, shared_from_this(), std::move(req)));
-            std::lock_guard<std::mutex> lock(mutex);
-            stats.queue_size++;
+        virtual void enqueue(http_request_ptr req) = 0;
+
+        // many requests by a single post
+        virtual void enqueue_batch(std::vector<http_request_ptr> reqs) = 0;
+
+        // fail the oldest request not written yet with http_pool_errc::dropped
+        virtual void drop_oldest() = 0;
+
+        // close the connection if no request is queued, e.g. to give its slot to another host
+        virtual void close() = 0;
+
+        // unsent requests of the host shared by its connections, a connection takes them when it is free
+        inline void set_host_queue(http_host_queue_ptr queue) {
+            host_queue = std::move(queue);
+        }
+
+        // take requests of the host queue, called by it for a connection waiting for work
+        virtual void pull() = 0;
+
+        // evicted by the pool: wait for no more requests of the host queue, close when idle
+        virtual void retire() = 0;
+
+        // connect and handshake ahead of requests, the connection stays idle keep-alive one,
+        // handler gets the connect result or at once the success of an open connection
+        virtual void warm(std::function<void(http_error)> handler) = 0;
+
+        // warm connection is replaced when it is closed: keep-alive time is over, the server or a failure
+        // closed it, or its slot went to another host; a free slot is taken for it, else it tries again later
+        inline void set_keep_warm(bool value) {
+            keep_warm = value;
+        }
+
+        // latency histograms and counters of the host
+        inline void set_metrics(http_host_metrics_ptr value) {
+            metrics = std::move(value);
+        }
+
+        // circuit breaker of the host, asked before each new connection
+        inline void set_breaker(http_circuit_breaker_ptr value) {
+            breaker = std::move(value);
+        }
+
+        // queue gates released by every completed or dropped request
+        inline void set_gates(http_queue_gate_ptr host, http_queue_gate_ptr total) {
+            host_gate = std::move(host);
+            total_gate = std::move(total);
+        }
+
+        // pool-wide budget of connections, the key tells the host for round-robin
+        inline void set_connection_gate(http_connection_gate_ptr gate, const void* key) {
+            connection_gate = std::move(gate);
+            connection_key = key;
+        }
+
+        // idle keep-alive connection holding a slot, closed when another host waits for one
+        inline bool is_parked() {
+            return parked.load(std::memory_order_relaxed);
+        }
+
+        // maximum number of requests written ahead of responses (HTTP/1.1 pipelining),
+        // set up before the first request, 1 means no pipelining
+        inline void set_pipeline(size_t depth) {
+            pipeline = depth > 0 ? depth : 1;
+        }
+
+        // http/2 of new connections, requests are multiplexed on streams of a single connection then;
+        // while a host known to speak h2 is connected, its connection takes the requests for its streams
+        inline void set_http2(http2_mode mode) {
+            http2 = mode;
         }
 
         inline size_t queue_size() {
-            // std::lock_guard lock(mutex);
-            return stats.queue_size;
+            return pending.load(std::memory_order_relaxed);
+        }
+
+        // time since the queue got empty, zero while any request is queued
+        inline steady_clock::duration idle_time(steady_clock::time_point now) {
+            if (pending.load(std::memory_order_relaxed) > 0) {
+                return steady_clock::duration::zero();
+            }
+            return now - steady_clock::time_point(steady_clock::duration(idle_since.load(std::memory_order_relaxed)));
         }
 
         inline http_client_stats get_stats(bool reset) {
-            std::mutex mutex;
+            std::lock_guard<std::mutex> lock(mutex);
             http_client_stats result = stats;
+            result.queue_size = queue_size();
             if (reset) {
                 stats.error_count = 0;
                 stats.total_requests = 0;
                 stats.bytes_written = 0;
                 stats.bytes_readed = 0;
+                stats.bytes_decoded = 0;
+                stats.handshake_count = 0;
+                stats.handshake_resumed = 0;
+                stats.dropped_count = 0;
                 stats.total_seconds = 0;
             }
-            return result;
+            return result;
+        }
+
+    protected:
+        std::mutex mutex;
+        http_client_stats stats;
+        size_t pipeline = 1;
+        http2_mode http2 = http2_off;
+        http_queue_gate_ptr host_gate, total_gate;
+        http_connection_gate_ptr connection_gate;
+        const void* connection_key = nullptr;
+        http_host_queue_ptr host_queue;
+        std::atomic<bool> parked{ false };
+        std::atomic<bool> keep_warm{ false };
+
+        // host room first: producers wait on the pool gate for room in both, its release wakes them
+        void release_gates() {
+            if (host_gate) host_gate->release();
+            if (total_gate) total_gate->release();
+        }
+
+        http_host_metrics_ptr metrics;
+        http_circuit_breaker_ptr breaker;
+
+        void record(http_timing timing, steady_clock::duration d) {
+            if (metrics) {
+                metrics->record(timing, d);
+            }
+        }
+
+        // enqueued and not completed requests, time the queue got empty
+        std::atomic<size_t> pending{ 0 };
+        std::atomic<steady_clock::rep> idle_since{ steady_clock::now().time_since_epoch().count() };
+    };
+
+    typedef std::shared_ptr<http_client> http_client_ptr;
+
+    //---------------------------------------------------------------------------------------------
+    // pool-wide budget of open connections, clients waiting for a slot are served round-robin by host,
+    // so a host with a huge backlog takes its turn like any other; 0 limit only counts
+
+    class http_connection_gate {
+    public:
+        typedef std::function<void()> waiter_type;
+
+        explicit http_connection_gate(size_t _limit = 0, size_t _quantum = 8)
+            : limit(_limit), quantum(_quantum)
+        {}
+
+        // take a slot, or queue the waiter which is called holding one,
+        // an idle connection is asked to give its slot back then
+        bool acquire(const void* key, waiter_type waiter) {
+            http_client_ptr idle;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto max = limit.load(std::memory_order_relaxed);
+                if (max == 0 || used < max) {
+                    used++;
+                    return true;
+                }
+                auto& queue = queues[key];
+                if (queue.empty()) {
+                    order.push_back(key);
+                }
+                queue.push_back(std::move(waiter));
+                waiting++;
+                while (!idle && !parked.empty()) {
+                    idle = parked.front().lock();
+                    parked.pop_front();
+                    if (idle && !idle->is_parked()) idle.reset();
+                }
+            }
+            if (idle) {
+                idle->close();
+            }
+            return false;
+        }
+
+        // take a slot only if one is free and nobody waits for it, idle connections are not closed for it
+        bool try_acquire() {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto max = limit.load(std::memory_order_relaxed);
+            if (max == 0 || (used < max && waiting == 0)) {
+                used++;
+                return true;
+            }
+            return false;
+        }
+
+        // the slot goes to the next host in turn
+        void release() {
+            waiter_type waiter;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto max = limit.load(std::memory_order_relaxed);
+                if (order.empty() || (max > 0 && used > max)) {
+                    used--;
+                    return;
+                }
+                waiter = next();
+            }
+            waiter();
+        }
+
+        // raised limit lets waiters in
+        void set_limit(size_t value, size_t _quantum) {
+            std::vector<waiter_type> granted;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                limit = value;
+                quantum = _quantum > 0 ? _quantum : 1;
+                while (!order.empty() && (value == 0 || used < value)) {
+                    used++;
+                    granted.push_back(next());
+                }
+            }
+            for (auto& waiter : granted) {
+                waiter();
+            }
+        }
+
+        // connection of the host is idle, its slot may be reclaimed
+        void park(const http_client_ptr& client) {
+            if (limit.load(std::memory_order_relaxed) == 0) return;
+            std::lock_guard<std::mutex> lock(mutex);
+            if (parked.size() > 2 * used + 16) {
+                parked.erase(std::remove_if(parked.begin(), parked.end(), [](const std::weak_ptr<http_client>& ptr) {
+                    auto client = ptr.lock();
+                    return !client || !client->is_parked();
+                }), parked.end());
+            }
+            parked.push_back(client);
+        }
+
+        // other hosts wait for a slot
+        bool contended(const void* key) {
+            if (waiting.load(std::memory_order_relaxed) == 0) {
+                return false;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            auto ptr = queues.find(key);
+            return waiting > (ptr == queues.end() ? 0 : ptr->second.size());
+        }
+
+        size_t size() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return used;
+        }
+
+        size_t waiting_count() {
+            return waiting.load(std::memory_order_relaxed);
+        }
+
+        std::atomic<size_t> limit;
+        std::atomic<size_t> quantum;    // requests a connection serves before its slot may go to another host
+
+    private:
+        std::mutex mutex;
+        size_t used = 0;
+        std::atomic<size_t> waiting{ 0 };
+        std::unordered_map<const void*, std::deque<waiter_type> > queues;
+        std::deque<const void*> order;
+        std::deque<std::weak_ptr<http_client> > parked;
+
+        // first waiter of the host in turn, the host goes to the back if it has more, must be locked
+        waiter_type next() {
+            auto key = order.front();
+            order.pop_front();
+            auto ptr = queues.find(key);
+            auto waiter = std::move(ptr->second.front());
+            ptr->second.pop_front();
+            waiting--;
+            if (ptr->second.empty()) {
+                queues.erase(ptr);
+            }
+            else {
+                order.push_back(key);
+            }
+            return waiter;
+        }
+    };
+
+    //---------------------------------------------------------------------------------------------
+    // unsent requests of a host, its connections pull them when they are free, so a stalled connection
+    // holds up only the requests on its wire; ordered by priority class like the connection queue,
+    // a timer at the earliest deadline fails the expired ones while no connection is free
+
+    class http_host_queue :
+        public http_request_owner,
+        public std::enable_shared_from_this<http_host_queue>
+    {
+    public:
+        http_host_queue(const asio_executor& ex, http_queue_gate_ptr host, http_queue_gate_ptr total, http_host_metrics_ptr _metrics)
+            : executor(ex), strand(asio::make_strand(ex)), timer(strand), host_gate(std::move(host)), total_gate(std::move(total)), metrics(std::move(_metrics))
+        {}
+
+        bool push(const http_request_ptr& req) {
+            return push(&req, &req + 1) > 0;
+        }
+
+        size_t push(const std::vector<http_request_ptr>& reqs) {
+            return push(reqs.data(), reqs.data() + reqs.size());
+        }
+
+        // count of connections woken to take the requests, one per request at most
+        // (a wake only posts to the connection strand, so it is done under the lock)
+        size_t push(const http_request_ptr* first, const http_request_ptr* last) {
+            auto self = shared_from_this();
+            auto now = steady_clock::now();
+            std::vector<http_request_ptr> cancelled;
+            size_t woken = 0;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (auto ptr = first; ptr != last; ++ptr) {
+                    auto& req = *ptr;
+                    if (!req->attach(self)) {
+                        cancelled.push_back(req);
+                        continue;
+                    }
+                    req->timing.queued = now;
+                    insert(req);
+                    arm(req->expiry());
+                }
+                auto count = static_cast<size_t>(last - first) - cancelled.size();
+                while (woken < count && !waiters.empty()) {
+                    if (auto client = waiters.front().lock()) {
+                        client->pull();
+                        woken++;
+                    }
+                    waiters.pop_front();
+                }
+            }
+            for (auto& req : cancelled) {
+                discard(req, asio::error::operation_aborted);
+            }
+            return woken;
+        }
+
+        // the next request, or null and the connection is woken by the next push if it waits
+        http_request_ptr pop(const http_client_ptr& client, bool wait) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (requests.empty()) {
+                if (wait) {
+                    waiters.push_back(client);
+                }
+                return nullptr;
+            }
+            auto req = std::move(requests.front());
+            requests.pop_front();
+            return req;
+        }
+
+        // the oldest request of the lowest class leaves the queue, null if there is none; the caller fails it
+        // with http_pool_errc::dropped by discard() once out of its locks, as that releases the gates
+        http_request_ptr remove_oldest() {
+            http_request_ptr req;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (requests.empty()) return nullptr;
+                size_t index = 0;
+                for (size_t i = 1; i < requests.size(); i++) {
+                    if (requests[i]->priority() > requests[index]->priority()) index = i;
+                }
+                req = std::move(requests[index]);
+                requests.erase(requests.begin() + index);
+            }
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            if (metrics) {
+                metrics->dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+            return req;
+        }
+
+        virtual void on_cancel(http_request* ptr) {
+            http_request_ptr req;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto found = std::find_if(requests.begin(), requests.end(), [ptr](const http_request_ptr& req) { return req.get() == ptr; });
+                if (found == requests.end()) return;
+                req = std::move(*found);
+                requests.erase(found);
+            }
+            discard(req, asio::error::operation_aborted);
+        }
+
+        size_t size() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return requests.size();
+        }
+
+        // a connection waits for work, so a push is taken at once
+        bool has_waiting() {
+            std::lock_guard<std::mutex> lock(mutex);
+            while (!waiters.empty() && waiters.front().expired()) {
+                waiters.pop_front();
+            }
+            return !waiters.empty();
+        }
+
+        size_t dropped_count(bool reset) {
+            return reset ? dropped.exchange(0) : dropped.load();
+        }
+
+        // request leaves before any connection took it
+        void discard(const http_request_ptr& req, http_error err) {
+            if (host_gate) host_gate->release();
+            if (total_gate) total_gate->release();
+            if (metrics) {
+                metrics->complete(err, http_stage_none, 0);
+            }
+            asio::post(executor, [req, err]() {
+                req->end(err, http_stage_none);
+            });
+        }
+
+    private:
+        asio_executor executor;
+        asio_strand strand;
+        asio_timer timer;
+        steady_clock::time_point armed;
+        http_queue_gate_ptr host_gate, total_gate;
+        http_host_metrics_ptr metrics;
+        std::mutex mutex;
+        std::deque<http_request_ptr> requests;
+        std::deque<std::weak_ptr<http_client> > waiters;
+        std::atomic<size_t> dropped{ 0 };
+
+        // an earlier deadline moves the timer, posted under the lock so the strand sees them in order
+        void arm(steady_clock::time_point until) {
+            if (until == steady_clock::time_point() || (armed != steady_clock::time_point() && armed <= until)) return;
+            armed = until;
+            asio::post(strand, http_recycled(std::bind(&http_host_queue::wait, shared_from_this())));
+        }
+
+        void wait() {
+            steady_clock::time_point until;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                until = armed;
+            }
+            if (until == steady_clock::time_point()) return;
+            auto self = shared_from_this();
+            timer.expires_at(until);
+            timer.async_wait([self](http_error err) {
+                if (!err) self->expire();
+            });
+        }
+
+        // expired requests leave with beast::error::timeout, the timer moves to the next deadline
+        void expire() {
+            std::vector<http_request_ptr> expired;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                armed = steady_clock::time_point();
+                for (auto ptr = requests.begin(); ptr != requests.end();) {
+                    if ((*ptr)->expired()) {
+                        expired.push_back(std::move(*ptr));
+                        ptr = requests.erase(ptr);
+                        continue;
+                    }
+                    arm((*ptr)->expiry());
+                    ++ptr;
+                }
+            }
+            for (auto& req : expired) {
+                discard(req, beast::error::timeout);
+            }
+        }
+
+        // behind the requests of the same or a higher class, must be locked
+        void insert(const http_request_ptr& req) {
+            auto ptr = requests.end();
+            while (ptr != requests.begin() && (*(ptr - 1))->priority() > req->priority()) {
+                --ptr;
+            }
+            requests.insert(ptr, req);
+        }
+    };
+
+    //---------------------------------------------------------------------------------------------
+    // connection over http_tcp_stream or http_ssl_stream, the stream type is known at compile time,
+    // so requests get the concrete stream and beast operations get the completion handler as is
+
+    template<typename stream_type>
+    class basic_http_client :
+        public http_client,
+        public http2_session_owner,
+        public std::enable_shared_from_this<basic_http_client<stream_type> >
+    {
+    public:
+        using http_client::enqueue;
+
+        template<typename executor_type>
+        explicit basic_http_client(const executor_type& ex, http_string _host, http_string _port, http_resolver_cache_ptr _dns = nullptr)
+            : strand(client_strand(ex)), resolver(strand), timer(strand), queue_timer(strand), dns(std::move(_dns)), host(_host), port(_port)
+        {}
+
+#ifndef ASIO_POOL_HTTPS_IGNORE
+        template<typename executor_type>
+        explicit basic_http_client(const executor_type& ex, http_string _host, http_string _port, https_method _method, http_resolver_cache_ptr _dns = nullptr)
+            : strand(client_strand(ex)), resolver(strand), timer(strand), queue_timer(strand), dns(std::move(_dns)), host(_host), port(_port), hostname(_host)
+        {
+            stream.configure(_method);
+        }
+
+        // connections to the same host share ssl context and resume its sessions
+        template<typename executor_type>
+        explicit basic_http_client(const executor_type& ex, http_string _host, http_string _port, http_ssl_context_ptr _context, http_resolver_cache_ptr _dns = nullptr)
+            : strand(client_strand(ex)), resolver(strand), timer(strand), queue_timer(strand), dns(std::move(_dns)), host(_host), port(_port), hostname(_host)
+        {
+            stream.configure(std::move(_context));
+        }
+#endif
+
+        virtual void enqueue(http_request_ptr req) {
+            auto self = this->shared_from_this();
+            req->attach(self);
+            req->timing.queued = steady_clock::now();
+            pending.fetch_add(1, std::memory_order_relaxed);
+            asio::post(strand, http_recycled(std::bind(&basic_http_client::append, std::move(self), std::move(req))));
+        }
+
+        virtual void enqueue_batch(std::vector<http_request_ptr> reqs) {
+            if (reqs.empty()) return;
+            auto self = this->shared_from_this();
+            auto now = steady_clock::now();
+            for (auto& req : reqs) {
+                req->attach(self);
+                req->timing.queued = now;
+                pending.fetch_add(1, std::memory_order_relaxed);
+            }
+            asio::post(strand, http_recycled(std::bind(&basic_http_client::append_batch, std::move(self), std::move(reqs))));
+        }
+
+        virtual void drop_oldest() {
+            asio::post(strand, http_recycled(std::bind(&basic_http_client::drop_unsent, this->shared_from_this())));
+        }
+
+        virtual void close() {
+            asio::post(strand, http_recycled(std::bind(&basic_http_client::close_idle, this->shared_from_this())));
+        }
+
+        virtual void pull() {
+            asio::post(strand, http_recycled(std::bind(&basic_http_client::on_work, this->shared_from_this())));
+        }
+
+        virtual void retire() {
+            asio::post(strand, http_recycled(std::bind(&basic_http_client::close_retired, this->shared_from_this())));
+        }
+
+        virtual void warm(std::function<void(http_error)> handler) {
+            asio::post(strand, http_recycled(std::bind(&basic_http_client::connect_ahead, this->shared_from_this(), std::move(handler))));
+        }
+
+        virtual ~basic_http_client() {
+            if (slot) {
+                connection_gate->release();
+            }
+        }
+
+        // the pointer is only compared, the request may be gone already
+        virtual void on_cancel(http_request* req) {
+            asio::post(strand, http_recycled(std::bind(&basic_http_client::abort, this->shared_from_this(), req)));
         }
 
     protected:
-        system_clock::time_point started = system_clock::now();
-        asio_executor executor;
+        steady_clock::time_point started = steady_clock::now();
+        steady_clock::time_point stage_started;
+        asio_strand strand;
         tcp_resolver resolver;
         async_timer timer;
-        http_stream stream;
+        asio_timer queue_timer;
+        http_resolver_cache_ptr dns;
+        stream_type stream;
+        tcp_endpoint preferred;
         std::string host, port;
+        std::string hostname;
         std::deque<http_request_ptr> requests;
-        std::mutex mutex;
-        http_client_stats stats;
         int trycnt = 0;
 
-#ifndef ASIO_POOL_HTTPS_IGNORE
-        std::string hostname;
-#endif
-    
+        // waits for the host queue, takes no more from it
+        bool waiting_work = false;
+        bool retired = false;
+
+        // the connection probes the host for its half open circuit breaker
+        bool probing = false;
+
+        // wait for the connection opened ahead of requests
+        std::vector<std::function<void(http_error)> > warm_handlers;
+
+        // connection slot of the pool and requests served on it
+        bool slot = false;
+        bool slot_waiting = false;
+        size_t slot_served = 0;
+
+        // the earliest deadline of the requests not on the wire
+        steady_clock::time_point queue_deadline;
+
+        // cancelled requests still used by outdated operations
+        std::vector<http_request_ptr> aborted;
+        bool read_aborted = false;
+
+        // connection state, the first "written" requests are sent and wait for responses
+        unsigned int generation = 0;
+        size_t written = 0;
+        size_t responses = 0;
+        bool connecting = false;
+        bool connected = false;
+        bool writing = false;
+        bool reading = false;
+        bool pipeline_fallback = false;
+        int pipeline_failures = 0;
+
+        // http/2 connection, the first "written" requests are on its streams and complete in any order
+        std::shared_ptr<http2_session<stream_type> > session;
+
+        // the strand given by the pool, or a new one over any other executor
+        static const asio_strand& client_strand(const asio_strand& ex) {
+            return ex;
+        }
+        template<typename executor_type>
+        static asio_strand client_strand(const executor_type& ex) {
+            return asio_strand(ex);
+        }
+
         bool check_result(http_error err, http_stage stage, size_t bytes = 0) {
             auto complete = stage == http_stage_complete || err;
 
             // on error reset stream
             if (err) {
-                stream.reset();
+
+                // server dropped the pipeline before any answer, resend one by one
+                // till the next response, and give up pipelining if it happens again and again
+                if (!session && written > 1 && responses == 0) {
+                    pipeline_fallback = true;
+                    if (++pipeline_failures >= 3) {
+                        pipeline = 1;
+                    }
+                }
+                reset();
+                if (stage <= http_stage_handshake) {
+                    warmed(err);
+                    if (requests.empty()) {
+                        retry_warm();
+                    }
+                }
 
                 // may be stream closed, reconnect and try again
-                if (trycnt == 0 && (stage == http_stage_write || stage == http_stage_read)) {
+                if (trycnt == 0 && (stage == http_stage_write || stage == http_stage_read) && !requests.empty() && requests.front()->replayable() && !requests.front()->expired()) {
                     trycnt++;
-                    asio::post(executor, std::bind(&http_client::next, shared_from_this()));
+                    if (metrics) {
+                        metrics->retries.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    asio::post(strand, http_recycled(std::bind(&basic_http_client::next, this->shared_from_this())));
                     complete = false;
                 }
             }
@@ -125,8 +1195,17 @@ namespace tms {
                 trycnt = 0;
                 set_complete(err, stage);
             }
+            update_stats(err, stage, bytes, complete);
+            return !err.failed();
+        }
 
-            // update stats
+        void update_stats(http_error err, http_stage stage, size_t bytes, bool complete) {
+            if (metrics && bytes > 0) {
+                ((stage == http_stage_write) ? metrics->bytes_written : metrics->bytes_readed).fetch_add(bytes, std::memory_order_relaxed);
+                if (stage != http_stage_write) {
+                    metrics->bytes_decoded.fetch_add(bytes, std::memory_order_relaxed);
+                }
+            }
             std::lock_guard<std::mutex> lock(mutex);
             if (err) {
                 stats.state = 0;
@@ -137,26 +1216,84 @@ namespace tms {
             }
             if (bytes > 0) {
                 ((stage == http_stage_write) ? stats.bytes_written : stats.bytes_readed) += bytes;
+                if (stage != http_stage_write) {
+                    stats.bytes_decoded += bytes;
+                }
             }
             if (complete) {
-                std::chrono::duration<double/*, std::milli*/> tmout = system_clock::now() - started;
+                auto now = steady_clock::now();
+                std::chrono::duration<double/*, std::milli*/> tmout = now - started;
+                started = now;
                 stats.total_seconds += tmout.count();
                 stats.total_requests++;
-                stats.queue_size = requests.size();
             }
-            return !err.failed();
         }
 
-        void set_complete(http_error err, http_stage stage) {
+        // decoded bytes count the body of a compressed response as decoded, the difference wraps when it shrank
+        void update_decoded(http_request& req) {
+            auto size = req.decoded_size();
+            if (size.encoded == 0) return;
+            auto delta = size.decoded - size.encoded;
+            if (metrics) {
+                metrics->bytes_decoded.fetch_add(delta, std::memory_order_relaxed);
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            stats.bytes_decoded += delta;
+        }
+
+        // http/2 streams complete the request at their index, http/1.1 ones the first request
+        void set_complete(http_error err, http_stage stage, size_t index = 0) {
             auto cnt = requests.size();
-            if (cnt > 0) {
-                auto req = requests.front();
-                requests.pop_front();
+            if (index < cnt) {
+                auto req = requests[index];
+                requests.erase(requests.begin() + index);
+                pending.fetch_sub(1, std::memory_order_relaxed);
+                release_gates();
+                if (written > index) {
+                    written--;
+                }
+
+                // the next one may come from the host queue
+                take_work();
+                cnt = requests.size() + 1;
+                if (cnt == 1) {
+                    idle_since.store(steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+                }
+
+                // server closes connection after response, resend the rest ones
+                if (!err && connected && !req->keep_alive()) {
+                    stream.shutdown();
+                    reset();
+                }
+
+                // another host waits for a slot: served enough gives it away, idle one does not keep it,
+                // neither from a connection of its own host, the waiting one holds requests taken from the queue
+                slot_served++;
+                if (connected && written == 0 && (cnt == 1 ? idle_contended() : must_yield())) {
+                    stream.shutdown();
+                    reset();
+                }
                 if (cnt > 1) {
-                    asio::post(executor, std::bind(&http_client::next, shared_from_this()));
+                    asio::post(strand, http_recycled(std::bind(&basic_http_client::next, this->shared_from_this())));
                 }
-                else if (!err) {
+                else if (!err && connected) {
                     keep_alive(req->get("keep-alive"));
+                    park();
+                }
+                else {
+                    rewarm();
+                }
+                if (metrics) {
+                    metrics->complete(err, stage, req->status());
+                }
+                if (breaker) {
+                    breaker->record(err, stage, req->status());
+                    probing = false;
+                }
+
+                // outdated operations of dropped connection may still use it
+                if (!connected && (reading || writing)) {
+                    aborted.push_back(req);
                 }
                 req->end(err, stage);
             }
@@ -176,9 +1313,9 @@ namespace tms {
 
         void keep_alive(int timeout = 0) {
             if (timeout > 0) {
-                auto self = shared_from_this();
+                auto self = this->shared_from_this();
                 timer.wait(async_timer::seconds(timeout), [self]() {
-                    self->shutdown();
+                    self->expire();
                 });
             }
             else {
@@ -189,91 +1326,754 @@ namespace tms {
         void shutdown() {
             if (requests.empty() && stream.valid()) {
                 stream.shutdown();
-                stream.reset();
+                reset();
+            }
+        }
+
+        // keep-alive time is over, a connection kept warm opens a fresh one
+        void expire() {
+            shutdown();
+            rewarm();
+        }
+
+        // idle keep-alive connection holds its slot till another host waits for one
+        void park() {
+            if (connection_gate) {
+                parked = true;
+                connection_gate->park(this->shared_from_this());
+            }
+        }
+
+        // connection without requests, a connecting or busy one completes the handler when it is ready;
+        // outdated operations of a dropped connection complete first, on_outdated() comes back then
+        void connect_ahead(std::function<void(http_error)>& handler) {
+            if (handler) {
+                warm_handlers.push_back(std::move(handler));
+            }
+            if (connected && stream.valid()) {
+                return warmed(http_error());
+            }
+            if (connecting || reading || writing || !requests.empty()) {
+                return;
+            }
+            if (retired) {
+                return warmed(asio::error::operation_aborted);
+            }
+
+            // the connection may be the probe of a half open breaker, its first request answers it
+            if (breaker && !probing) {
+                auto permit = breaker->allow();
+                if (permit == http_circuit_breaker::permit_denied || permit == http_circuit_breaker::permit_wait) {
+                    retry_warm();
+                    return warmed(http_pool_errc::circuit_open);
+                }
+                probing = permit == http_circuit_breaker::permit_probe;
+            }
+
+            // a replacement does not wait for a slot, prewarm does
+            if (warm_handlers.empty() ? take_free_slot() : take_slot()) {
+                return connect();
+            }
+            if (warm_handlers.empty()) {
+                abandon_probe();
+                retry_warm();
+            }
+        }
+
+        // idle client without a connection opens one if it is kept warm or prewarm waits for it
+        void rewarm() {
+            if (connected || connecting || !requests.empty()) return;
+            if (warm_handlers.empty() && (!keep_warm || retired)) return;
+            std::function<void(http_error)> none;
+            connect_ahead(none);
+        }
+
+        // failed or slotless replacement tries again later, a request coming meanwhile cancels the timer
+        void retry_warm() {
+            if (!keep_warm || retired || !requests.empty()) return;
+            auto self = this->shared_from_this();
+            timer.wait(async_timer::seconds(http_timeouts::warm_retry), [self]() {
+                self->rewarm();
+            });
+        }
+
+        void warmed(http_error err) {
+            if (warm_handlers.empty()) return;
+            auto handlers = std::move(warm_handlers);
+            warm_handlers.clear();
+            for (auto& handler : handlers) {
+                handler(err);
+            }
+        }
+
+        // the keep-alive timer holds the client, so it goes away with the last request
+        void close_idle() {
+            if (requests.empty()) {
+                keep_alive(0);
+                shutdown();
+                retry_warm();
+            }
+        }
+
+        void close_retired() {
+            retired = true;
+            close_idle();
+        }
+
+        // requests of the host queue up to the pipeline depth, without any the connection waits for the next push
+        void take_work() {
+            if (!host_queue || waiting_work) return;
+            auto self = this->shared_from_this();
+            auto limit = session ? session->capacity() : (!connected && expects_h2() ? http2_session<stream_type>::max_streams : pipeline);
+            while (requests.size() < limit) {
+                auto req = host_queue->pop(self, !retired);
+                if (!req) {
+                    waiting_work = !retired;
+                    return;
+                }
+                pending.fetch_add(1, std::memory_order_relaxed);
+                if (!req->attach(self)) {
+                    discard(req, asio::error::operation_aborted);
+                    continue;
+                }
+                insert(std::move(req));
+            }
+        }
+
+        void on_work() {
+            waiting_work = false;
+            refill();
+        }
+
+        // h2 before the connection tells it: known by prior knowledge, or by ALPN of the last connection to the host
+        bool expects_h2() {
+            return stream_type::secure ? (http2 != http2_off && stream.expects_h2()) : http2 == http2_prior_knowledge;
+        }
+
+        // the host fell back to http/1.1, the requests taken for h2 streams beyond the pipeline go back to the host queue
+        void give_back() {
+            if (!host_queue || requests.size() <= pipeline) return;
+            std::vector<http_request_ptr> reqs(requests.begin() + pipeline, requests.end());
+            requests.erase(requests.begin() + pipeline, requests.end());
+            pending.fetch_sub(reqs.size(), std::memory_order_relaxed);
+            host_queue->push(reqs);
+        }
+
+        void refill() {
+            auto idle = requests.empty();
+            take_work();
+            if (idle && !requests.empty()) {
+                process();
+            }
+            else if (connected && (pipeline > 1 || session)) {
+                send();
+            }
+        }
+
+        // drop connection, written but unanswered requests will be sent again, the socket is closed
+        // and pending read/write operations complete as outdated ones; http/2 streams complete at once,
+        // their requests that can not be sent again fail
+        void reset() {
+            std::vector<http_request_ptr> broken;
+            if (session) {
+                session->close();
+                session.reset();
+                for (size_t i = 0; i < written && i < requests.size();) {
+                    if (requests[i]->replayable()) {
+                        i++;
+                        continue;
+                    }
+                    broken.push_back(std::move(requests[i]));
+                    requests.erase(requests.begin() + i);
+                    written--;
+                }
+            }
+            else if (reading && !requests.empty()) {
+                requests.front()->on_dropped();
+            }
+            stream.reset();
+            generation++;
+            written = 0;
+            connecting = connected = false;
+            release_slot();
+            abandon_probe();
+            for (auto& req : broken) {
+                req->on_dropped();
+                discard(req, asio::error::connection_aborted);
+            }
+        }
+
+        // slot for a new connection, false while waiting for it
+        bool take_slot() {
+            if (slot || !connection_gate) return true;
+            if (slot_waiting) return false;
+            auto self = this->shared_from_this();
+            if (!connection_gate->acquire(connection_key, [self]() { asio::post(self->strand, http_recycled(std::bind(&basic_http_client::on_slot, self))); })) {
+                slot_waiting = true;
+                return false;
+            }
+            slot = true;
+            slot_served = 0;
+            return true;
+        }
+
+        // free slot only, no waiting for it
+        bool take_free_slot() {
+            if (slot || !connection_gate) return true;
+            if (slot_waiting || !connection_gate->try_acquire()) return false;
+            slot = true;
+            slot_served = 0;
+            return true;
+        }
+
+        void on_slot() {
+            slot_waiting = false;
+            slot = true;
+            slot_served = 0;
+            if (requests.empty()) {
+                if (warm_handlers.empty() || connecting || reading || writing) {
+                    return release_slot();
+                }
+                return connect();
+            }
+            process();
+        }
+
+        void release_slot() {
+            parked = false;
+            if (slot) {
+                slot = false;
+                connection_gate->release();
+            }
+        }
+
+        bool contended() {
+            return connection_gate && connection_gate->contended(connection_key);
+        }
+
+        bool idle_contended() {
+            return connection_gate && connection_gate->waiting_count() > 0;
+        }
+
+        bool must_yield() {
+            return connection_gate && slot_served >= connection_gate->quantum.load(std::memory_order_relaxed) && contended();
+        }
+
+        // outdated operation completed, reconnect when the last one is gone
+        void on_outdated() {
+            if (!reading && !writing) {
+                aborted.clear();
+                next();
             }
         }
 
         void append(http_request_ptr req) {
-            requests.push_back(std::move(req));
+            if (req->is_cancelled()) {
+                return discard(req, asio::error::operation_aborted);
+            }
+            insert(std::move(req));
             if (requests.size() == 1) {
                 process();
             }
+            else if (connected && (pipeline > 1 || session)) {
+                send();
+            }
+        }
+
+        void append_batch(std::vector<http_request_ptr>& reqs) {
+            auto idle = requests.empty();
+            for (auto& req : reqs) {
+                if (req->is_cancelled()) {
+                    discard(req, asio::error::operation_aborted);
+                    continue;
+                }
+                insert(std::move(req));
+            }
+            if (idle && !requests.empty()) {
+                process();
+            }
+            else if (connected && (pipeline > 1 || session)) {
+                send();
+            }
+        }
+
+        // ahead of the unsent requests of a lower class, behind the ones on the wire and the one being retried;
+        // outdated operations of dropped connection may still use any request, the order is kept then
+        void insert(http_request_ptr req) {
+            auto ptr = requests.end();
+            if (connected || (!reading && !writing)) {
+                auto first = requests.begin() + std::min(std::max<size_t>(written + (writing ? 1 : 0), trycnt > 0 ? 1 : 0), requests.size());
+                auto priority = req->priority();
+                while (ptr > first && (*(ptr - 1))->priority() > priority) {
+                    --ptr;
+                }
+            }
+            arm_queue(req->expiry());
+            requests.insert(ptr, std::move(req));
+        }
+
+        // the timer moves to an earlier deadline only, a later one is armed when it fires
+        void arm_queue(steady_clock::time_point until) {
+            if (until == steady_clock::time_point() || (queue_deadline != steady_clock::time_point() && queue_deadline <= until)) return;
+            queue_deadline = until;
+            auto self = this->shared_from_this();
+            queue_timer.expires_at(until);
+            queue_timer.async_wait([self](http_error err) {
+                if (!err) self->on_queue_timer();
+            });
+        }
+
+        // requests expired before they were sent leave with beast::error::timeout, unless outdated operations
+        // of dropped connection may still use them, the next process() drops them then
+        void on_queue_timer() {
+            queue_deadline = steady_clock::time_point();
+            auto index = written + (writing ? 1 : 0);
+            for (auto i = index; i < requests.size();) {
+                auto req = requests[i];
+                auto expired = req->expired();
+                if (!expired) {
+                    arm_queue(req->expiry());
+                }
+                if (!expired || (!connected && (reading || writing))) {
+                    i++;
+                    continue;
+                }
+                requests.erase(requests.begin() + i);
+                if (i == 0) {
+                    trycnt = 0;
+                }
+                discard(req, beast::error::timeout);
+            }
+        }
+
+        // the first "written" requests and the one being written are on the wire, of the rest the oldest of the lowest class
+        // is dropped; outdated operations of dropped connection may still use any request, nothing is dropped then
+        void drop_unsent() {
+            if (!connected && (writing || reading)) return;
+            auto index = written + (writing ? 1 : 0);
+            if (index >= requests.size()) return;
+            for (auto i = index + 1; i < requests.size(); i++) {
+                if (requests[i]->priority() > requests[index]->priority()) index = i;
+            }
+            auto ptr = requests.begin() + index;
+            auto req = *ptr;
+            requests.erase(ptr);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stats.dropped_count++;
+            }
+            if (metrics) {
+                metrics->dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+            discard(req, http_pool_errc::dropped);
+        }
+
+        // cancelled request leaves the queue, if it is on the wire the connection is dropped
+        // and the rest ones are sent again
+        void abort(http_request* req) {
+            auto ptr = std::find_if(requests.begin(), requests.end(), [req](const http_request_ptr& r) { return r.get() == req; });
+            // the same address may be taken by a new request
+            if (ptr == requests.end() || !(*ptr)->is_cancelled()) return;
+            size_t index = ptr - requests.begin();
+            auto found = *ptr;
+            if (session && index < written) {
+                // only its stream is reset
+                session->cancel(req);
+                written--;
+            }
+            else if (connected ? index < written + (writing ? 1 : 0) : (reading || writing)) {
+                aborted.push_back(found);
+                if (reading && index == 0) {
+                    read_aborted = true;
+                }
+                if (connected) {
+                    reset();
+                }
+            }
+            requests.erase(ptr);
+            if (index == 0) {
+                trycnt = 0;
+            }
+            discard(found, asio::error::operation_aborted);
+        }
+
+        // requests expired in the queue leave it without taking the connection
+        void drop_expired(size_t index) {
+            while (index < requests.size() && requests[index]->expired()) {
+                auto req = requests[index];
+                requests.erase(requests.begin() + index);
+                discard(req, beast::error::timeout);
+            }
+        }
+
+        // request removed from the queue before completion
+        void discard(const http_request_ptr& req, http_error err) {
+            pending.fetch_sub(1, std::memory_order_relaxed);
+            if (requests.empty()) {
+                abandon_probe();
+                idle_since.store(steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+                if (!connected && !connecting) {
+                    release_slot();
+                }
+                if (host_queue) {
+                    asio::post(strand, http_recycled(std::bind(&basic_http_client::refill, this->shared_from_this())));
+                }
+            }
+            release_gates();
+            if (metrics) {
+                metrics->complete(err, http_stage_none, 0);
+            }
+            req->end(err, http_stage_none);
+        }
+
+        // circuit breaker of the host is open, nothing is on the wire, the queued requests fail at once
+        void fail_fast() {
+            while (!requests.empty()) {
+                auto req = requests.front();
+                requests.pop_front();
+                discard(req, http_pool_errc::circuit_open);
+            }
+            warmed(http_pool_errc::circuit_open);
+        }
+
+        // the probe gave no answer, so the breaker is asked again by the next connect
+        void abandon_probe() {
+            if (probing) {
+                probing = false;
+                breaker->abandon();
+            }
         }
 
         void next() {
             if (!requests.empty()) {
-                process();
+                return process();
             }
+            rewarm();
         }
 
         void process() {
-            if (trycnt == 0) {
-                started = system_clock::now();
+            if (trycnt == 0 && written == 0) {
+                started = steady_clock::now();
             }
             keep_alive(0);
-            if (stream.valid()) {
-                return send();            
+            parked = false;
+            if (connected) {
+                if (stream.valid()) {
+                    return send();
+                }
+                reset();
             }
-            stream.init(executor);
-            auto self = shared_from_this();
-            resolver.async_resolve(host, port, beast::bind_front_handler(&http_client::on_resolve, self));
+            if (connecting || reading || writing) {
+                return;
+            }
+            drop_expired(0);
+            if (requests.empty()) {
+                return;
+            }
+            if (breaker && !probing) {
+                auto permit = breaker->allow();
+                if (permit == http_circuit_breaker::permit_denied) {
+                    return fail_fast();
+                }
+                if (permit == http_circuit_breaker::permit_wait) {
+                    // ask again shortly, the probe answers or runs out of time
+                    auto self = this->shared_from_this();
+                    timer.wait(async_timer::milliseconds(100), [self]() {
+                        self->next();
+                    });
+                    return;
+                }
+                probing = permit == http_circuit_breaker::permit_probe;
+            }
+            if (take_slot()) {
+                connect();
+            }
+        }
+
+        // resolve and connect, the slot is taken
+        void connect() {
+            connecting = true;
+            stream.init(strand);
+            stage_started = steady_clock::now();
+            auto self = this->shared_from_this();
+            if (dns) {
+                dns->async_resolve(host, port, strand, beast::bind_front_handler(&basic_http_client::on_resolve, self, generation));
+                return;
+            }
+            resolver.async_resolve(host, port, beast::bind_front_handler(&basic_http_client::on_resolve, self, generation));
+        }
+
+        // requests may be written ahead only after idempotent ones
+        bool can_write_ahead() {
+            if (written == 0) return true;
+            if (must_yield()) return false;
+            if (pipeline_fallback || written >= pipeline || written >= requests.size()) return false;
+            for (size_t i = 0; i <= written; i++) {
+                auto method = requests[i]->method();
+                if (method != http_verb::get && method != http_verb::head) return false;
+            }
+            return true;
         }
 
         void send() {
-            if (!requests.empty()) {
-                auto self = shared_from_this();
-                auto req = requests.front();
-                if (trycnt == 0) {
-                    req->set("host", host);
-                    req->set("connection", "keep-alive");
-                    req->set("user-agent", BOOST_BEAST_VERSION_STRING);
+            if (session) {
+                return send_streams();
+            }
+            auto self = this->shared_from_this();
+            if (!reading && written > 0) {
+                reading = true;
+                stream.expires_after(http_timeouts::read, requests.front()->expiry());
+                requests.front()->read(stream, http_process_handler(self, strand, generation, http_stage_read, stream.layer));
+            }
+            if (!writing) {
+                drop_expired(written);
+            }
+            if (!writing && written < requests.size() && can_write_ahead()) {
+                auto req = requests[written];
+                req->set("host", host);
+                req->set("connection", "keep-alive");
+                req->set("user-agent", BOOST_BEAST_VERSION_STRING);
+                auto now = steady_clock::now();
+                if (req->timing.sent == steady_clock::time_point()) {
+                    record(http_timing_queue, now - req->timing.queued);
                 }
-                stream.expires_after(http_timeouts::write);
-                req->write(stream, beast::bind_front_handler(&http_client::on_write, self));
+                req->timing.sent = now;
+                writing = true;
+                stream.expires_after(http_timeouts::write, req->expiry());
+                req->write(stream, http_process_handler(self, strand, generation, http_stage_write, stream.layer));
             }
         }
 
-        void on_resolve(http_error err, tcp_endpoints endpoints) {
-            if (check_result(err, http_stage_resolve)) {
-                auto self = shared_from_this();            
-                stream.expires_after(http_timeouts::connect);
-                stream.connect(endpoints, beast::bind_front_handler(&http_client::on_connect, self));
+        // each request on a new stream while the peer allows, the streams have the read timeout
+        void send_streams() {
+            drop_expired(written);
+            while (written < requests.size() && session->can_open()) {
+                auto req = requests[written];
+                req->set("host", host);
+                req->set("user-agent", BOOST_BEAST_VERSION_STRING);
+                auto now = steady_clock::now();
+                if (req->timing.sent == steady_clock::time_point()) {
+                    record(http_timing_queue, now - req->timing.queued);
+                }
+                req->timing.sent = now;
+                auto s = session->open(req, generation);
+                written++;
+                s->expires_after(http_timeouts::read, req->expiry());
+                req->write(*s, http_process_handler(s, strand, generation, http_stage_write));
+                req->read(*s, http_process_handler(s, strand, generation, http_stage_read));
+                drop_expired(written);
+            }
+
+            // the peer takes no more streams, the rest go on a new connection
+            if (session->is_going_away() && written == 0) {
+                stream.shutdown();
+                reset();
+                asio::post(strand, http_recycled(std::bind(&basic_http_client::next, this->shared_from_this())));
             }
         }
 
-        void on_connect(http_error err, tcp_endpoint endpoint) {
-            if (check_result(err, http_stage_connect)) {
-#ifndef ASIO_POOL_HTTPS_IGNORE
-                if (stream.ssl) {
-                    auto self = shared_from_this();
-                    stream.handshake(hostname, beast::bind_front_handler(&http_client::on_handshake, self));
+        virtual void on_stream(http2_stream& s, http_stage stage, http_error err, size_t transferred) {
+            if (s.generation != generation) return;
+            auto req = s.request;
+            auto ptr = std::find(requests.begin(), requests.begin() + std::min(written, requests.size()), req);
+            if (ptr == requests.begin() + std::min(written, requests.size())) return;
+            size_t index = ptr - requests.begin();
+            if (stage == http_stage_write) {
+                if (err) {
+                    // the response is not waited for
+                    s.write_error = err;
+                    session->send_reset(s, http2_errc::cancel);
+                    s.fail(err);
                     return;
                 }
-#endif
-                send();
+                auto& timing = req->timing;
+                timing.written = steady_clock::now();
+                record(http_timing_write, timing.written - timing.sent);
+                return update_stats(err, stage, transferred, false);
             }
+            if (s.write_error) {
+                err = s.write_error;
+                stage = http_stage_write;
+            }
+            session->finish(s);
+
+            // the peer did not process it, it goes ahead of the unsent requests again
+            if (err == http2_errc::refused_stream && req->replayable() && !req->expired()) {
+                requests.erase(ptr);
+                written--;
+                requests.insert(requests.begin() + written, req);
+                if (metrics) {
+                    metrics->retries.fetch_add(1, std::memory_order_relaxed);
+                }
+                asio::post(strand, http_recycled(std::bind(&basic_http_client::next, this->shared_from_this())));
+                return;
+            }
+            if (!err) {
+                responses++;
+                update_decoded(*req);
+                auto& timing = req->timing;
+                auto now = steady_clock::now();
+                if (timing.header >= timing.written) {
+                    record(http_timing_first_byte, timing.header - timing.written);
+                    record(http_timing_read, now - timing.header);
+                }
+                record(http_timing_total, now - timing.queued);
+            }
+            set_complete(err, err ? stage : http_stage_complete, index);
+            update_stats(err, stage, err ? 0 : transferred, true);
         }
 
-        void on_handshake(http_error err) {
-            if (check_result(err, http_stage_handshake)) {
-                send();
+        virtual void on_session(http_error err) {
+            if (!err) {
+                if (connected && session) {
+                    send();
+                }
+                return;
             }
+            if (written > 0) {
+                check_result(err, http_stage_read);
+                return;
+            }
+            reset();
+            next();
         }
 
-        void on_write(http_error err, size_t transferred) {
-            if (check_result(err, http_stage_write, transferred) && !requests.empty()) {
-                auto self = shared_from_this();
-                auto req = requests.front();
-                stream.expires_after(http_timeouts::read);
-                req->read(stream, beast::bind_front_handler(&http_client::on_read, self));
+        void on_resolve(unsigned int gen, http_error err, tcp_endpoints endpoints) {
+            if (gen != generation) return;
+            if (check_result(err, http_stage_resolve)) {
+                auto now = steady_clock::now();
+                record(http_timing_resolve, now - stage_started);
+                stage_started = now;
+                auto self = this->shared_from_this();
+                stream.expires_after(http_timeouts::connect, requests.empty() ? steady_clock::time_point() : requests.front()->expiry());
+                if (dns && endpoints.size() > 1) {
+                    preferred = dns->preferred(host, port);
+                }
+                stream.connect(endpoints, preferred, beast::bind_front_handler(&basic_http_client::on_connect, self, generation));
+            }
+        }
+
+        void on_connect(unsigned int gen, http_error err, tcp_endpoint endpoint) {
+            if (gen != generation) return;
+            if (check_result(stream.result(err), http_stage_connect)) {
+                auto now = steady_clock::now();
+                record(http_timing_connect, now - stage_started);
+                stage_started = now;
+                if (endpoint != preferred) {
+                    preferred = endpoint;
+                    if (dns) {
+                        dns->prefer(host, port, endpoint);
+                    }
+                }
+                handshake(std::integral_constant<bool, stream_type::secure>());
             }
         }
 
-        void on_read(http_error err, size_t transferred) {
+        void handshake(std::false_type) {
+            on_ready();
+        }
+
+        void handshake(std::true_type) {
+            auto self = this->shared_from_this();
+            stream.handshake(hostname, beast::bind_front_handler(&basic_http_client::on_handshake, self, generation));
+        }
+
+        void on_handshake(unsigned int gen, http_error err) {
+            if (gen != generation) return;
+            if (!err) {
+                record(http_timing_handshake, steady_clock::now() - stage_started);
+                auto resumed = stream.resumed();
+                std::lock_guard<std::mutex> lock(mutex);
+                stats.handshake_count++;
+                if (resumed) {
+                    stats.handshake_resumed++;
+                }
+            }
+            if (check_result(stream.result(err), http_stage_handshake)) {
+                on_ready();
+            }
+        }
+
+        void on_ready() {
+            if (metrics) {
+                metrics->connects.fetch_add(1, std::memory_order_relaxed);
+            }
+            connecting = false;
+            connected = true;
+            responses = 0;
+            if (stream_type::secure ? (http2 != http2_off && stream.alpn_h2()) : http2 == http2_prior_knowledge) {
+                session = std::make_shared<http2_session<stream_type> >(stream, strand);
+                session->start(this->shared_from_this());
+            }
+            if (stream_type::secure && http2 != http2_off) {
+                stream.remember_h2(session != nullptr);
+            }
+            if (!session) {
+                give_back();
+            }
+            warmed(http_error());
+            if (requests.empty()) {
+                // opened ahead of requests
+                keep_alive(http_timeouts::keep);
+                return park();
+            }
+            send();
+        }
+
+        virtual void on_process(unsigned int gen, http_stage stage, http_error err, size_t transferred) {
+            err = stream.result(err);
+            if (stage == http_stage_write) {
+                on_write(gen, err, transferred);
+            }
+            else {
+                on_read(gen, err, transferred);
+            }
+        }
+
+        void on_write(unsigned int gen, http_error err, size_t transferred) {
+            writing = false;
+            if (gen != generation) return on_outdated();
+            if (check_result(err, http_stage_write, transferred)) {
+                auto& timing = requests[written]->timing;
+                timing.written = steady_clock::now();
+                record(http_timing_write, timing.written - timing.sent);
+                written++;
+                send();
+            }
+        }
+
+        void on_read(unsigned int gen, http_error err, size_t transferred) {
+            reading = false;
+            if (gen != generation) {
+                // partially delivered response can not be read again, unless it was cancelled
+                auto owned = !read_aborted;
+                read_aborted = false;
+                if (owned && !requests.empty() && !requests.front()->replayable()) {
+                    check_result(err, err ? http_stage_read : http_stage_complete, transferred);
+                }
+                return on_outdated();
+            }
+            if (!err) {
+                responses++;
+                pipeline_fallback = false;
+                if (!requests.empty()) {
+                    update_decoded(*requests.front());
+                    auto& timing = requests.front()->timing;
+                    auto now = steady_clock::now();
+                    if (timing.header >= timing.written) {
+                        record(http_timing_first_byte, timing.header - timing.written);
+                        record(http_timing_read, now - timing.header);
+                    }
+                    record(http_timing_total, now - timing.queued);
+                }
+            }
             check_result(err, err ? http_stage_read : http_stage_complete, transferred);
         }
     };
 
-    typedef std::shared_ptr<http_client> http_client_ptr;
+    typedef basic_http_client<http_tcp_stream> http_tcp_client;
+#ifndef ASIO_POOL_HTTPS_IGNORE
+    typedef basic_http_client<http_ssl_stream> http_ssl_client;
+#endif
 
 }
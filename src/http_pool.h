@@ -1,9 +1,21 @@
 #pragma once
 #include "http_base.h"
 #include "http_client.h"
+#include "http_cache.h"
 
 namespace tms {
 
+    struct http_host_stats {
+        std::string host, port;
+        bool secure = false;
+        size_t connections = 0;
+        size_t queue_size = 0;
+        http_circuit_state circuit = http_circuit_closed;
+        size_t circuit_opened = 0;
+        http_latency_stats latency;
+        http_counters_stats counters;
+    };
+
     struct http_pool_stats {
         size_t host_count = 0;
         size_t active_count = 0;
@@ -12,9 +24,40 @@ namespace tms {
         size_t error_count = 0;
         size_t bytes_written = 0;
         size_t bytes_readed = 0;
+        size_t bytes_decoded = 0;
+        size_t handshake_count = 0;
+        size_t handshake_resumed = 0;
+        size_t waiting_count = 0;
+        size_t rejected_count = 0;
+        size_t dropped_count = 0;
+        size_t evicted_count = 0;
+        size_t connection_count = 0;
+        size_t connection_waiting = 0;
         double total_seconds = 0;
         double bandwidth = 0;
         double interval = 0;
+
+        // response cache counters since the previous reset, its size now
+        http_cache_stats cache;
+
+        // latencies of all hosts and of each one, e.g. latency.percentile(http_timing_total, 0.99)
+        http_latency_stats latency;
+        std::vector<http_host_stats> hosts;
+    };
+
+    // what enqueue does when the queue limit is reached
+    enum http_overflow {
+        http_overflow_reject = 0,       // fail the new request with http_pool_errc::queue_full
+        http_overflow_drop_oldest = 1,  // fail the oldest unsent request of the host with http_pool_errc::dropped
+        http_overflow_wait = 2          // async_enqueue_wait completes when there is room, enqueue rejects
+    };
+
+    // request of enqueue_batch, strings are used only during the call
+    struct http_batch_item {
+        http_string host;
+        http_string port;
+        optional<https_method> https;
+        http_request_ptr request;
     };
 
     class http_client_pool :
@@ -22,21 +65,206 @@ namespace tms {
     {
     public:    
         explicit http_client_pool(const asio_executor& ex, size_t _maxcon_per_host = 2)
-            : maxcon_per_host(_maxcon_per_host), executor(ex)
+            : maxcon_per_host(_maxcon_per_host), executor(ex), dns(std::make_shared<http_resolver_cache>(ex)), total_gate(std::make_shared<http_queue_gate>()), connection_gate(std::make_shared<http_connection_gate>()), cache(std::make_shared<http_response_cache>())
         {}
 
+        // queued (not completed) requests limits per host and for the whole pool, 0 is unlimited
+        void set_queue_limits(size_t per_host, size_t total, http_overflow policy = http_overflow_reject) {
+            host_limit = per_host;
+            overflow = policy;
+            total_gate->limit = total;
+            for (auto& shard : shards) {
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                for (auto& ptr : shard.hosts) {
+                    ptr.second.gate->limit = per_host;
+                }
+            }
+            total_gate->notify();
+        }
+
+        // circuit breaker of each host: failures in a row at the same stage, or the error rate of the last window requests,
+        // open it for open_time, enqueue and queued requests fail with http_pool_errc::circuit_open meanwhile,
+        // then a single connection probes the host; 0 failures disables it
+        void set_circuit_breaker(size_t failures, std::chrono::milliseconds open_time, double error_rate = 0, size_t window = 20) {
+            http_circuit_config config;
+            config.failures = failures;
+            config.open_time = open_time;
+            config.error_rate = error_rate;
+            config.window = window > 0 ? window : 1;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                circuit_config = config;
+            }
+            for (auto& shard : shards) {
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                for (auto& ptr : shard.hosts) {
+                    ptr.second.breaker->configure(config);
+                }
+            }
+        }
+
+        // open connections of the whole pool, 0 is unlimited; requests wait in their host queues while its connections
+        // wait for a slot, slots go round-robin by host, and a connection gives its slot to a waiting host after
+        // serving quantum requests, idle keep-alive ones give it at once
+        void set_connection_limit(size_t total, size_t quantum = 8) {
+            connection_gate->set_limit(total, quantum);
+        }
+
+        // connections without requests for the idle time are closed and removed, then hosts left without connections,
+        // over max_hosts the least recently used hosts without requests go too (counted per shard), 0 disables either;
+        // enqueue sweeps one shard at a time in passing
+        void set_eviction(std::chrono::seconds idle, size_t max_hosts = 0) {
+            idle_timeout = std::chrono::duration_cast<steady_clock::duration>(idle).count();
+            hosts_limit = max_hosts;
+        }
+
+        // sweep all shards now, e.g. by a timer while nothing is enqueued
+        void evict() {
+            auto now = steady_clock::now();
+            for (auto& shard : shards) {
+                evict(shard, now);
+            }
+        }
+
+        // enqueue waiting for room in the queue (http_overflow_wait), completes with void(http_error) once the request is queued,
+        // so producers slow down to the pace of upstream
+        template<typename token_type>
+        inline auto async_enqueue_wait(http_string host, http_string port, optional<https_method> https, http_request_ptr req, token_type&& token) {
+            return asio::async_initiate<token_type, void(http_error)>(
+                [this](auto handler, const std::string& host, const std::string& port, optional<https_method> https, http_request_ptr req) {
+                    using handler_type = decltype(handler);
+                    auto ex = asio::get_associated_executor(handler, executor);
+                    if (try_enqueue(host, port, https, req)) {
+                        asio::dispatch(ex, beast::bind_front_handler(std::move(handler), http_error()));
+                        return;
+                    }
+                    auto waiter = std::make_shared<optional<handler_type> >(std::move(handler));
+                    auto work = asio::prefer(ex, asio::execution::outstanding_work.tracked);
+                    total_gate->wait([this, host, port, https, req, waiter, work]() {
+                        if (!*waiter || !try_enqueue(host, port, https, req)) return false;
+                        auto h = std::move(**waiter);
+                        waiter->reset();
+                        asio::dispatch(work, beast::bind_front_handler(std::move(h), http_error()));
+                        return true;
+                    });
+                },
+                token, std::string(host), std::string(port), https, std::move(req));
+        }
+
+        // open up to count connections of the host (at most maxcon_per_host) ahead of traffic, completes with void(http_error)
+        // when all of them are connected and handshaked, or with the first error; keep_warm holds them open: a closed one
+        // is replaced when a slot is free, idle eviction skips the host
+        template<typename token_type>
+        inline auto async_prewarm(http_string host, http_string port, optional<https_method> https, size_t count, token_type&& token, bool keep_warm = false) {
+            return asio::async_initiate<token_type, void(http_error)>(
+                [this](auto handler, const std::string& host, const std::string& port, optional<https_method> https, size_t count, bool keep_warm) {
+                    using handler_type = decltype(handler);
+                    auto work = asio::prefer(asio::get_associated_executor(handler, executor), asio::execution::outstanding_work.tracked);
+                    auto method = https_key(https);
+                    auto hash = hash_key(host, port, method);
+                    auto& shard = shards[hash % shard_count];
+
+                    clients_list clients;
+                    http_error err;
+                    {
+                        std::lock_guard<std::mutex> lock(shard.mutex);
+                        auto& entry = find_host(shard, hash, host, port, method);
+                        count = std::min(count, maxcon_per_host);
+                        if (entry.breaker->is_open()) {
+                            err = http_pool_errc::circuit_open;
+                        }
+                        else {
+                            if (keep_warm) {
+                                entry.warm = std::max(entry.warm, count);
+                            }
+                            add_clients(entry, count - std::min(count, entry.clients.size()));
+                            clients.assign(entry.clients.begin(), entry.clients.begin() + std::min(count, entry.clients.size()));
+                        }
+                    }
+                    if (clients.empty()) {
+                        asio::dispatch(work, beast::bind_front_handler(std::move(handler), err));
+                        return;
+                    }
+
+                    // the last connection ready completes the handler with the first error
+                    struct warm_state {
+                        std::mutex mutex;
+                        size_t remaining;
+                        http_error err;
+                        optional<handler_type> handler;
+                    };
+                    auto state = std::make_shared<warm_state>();
+                    state->remaining = clients.size();
+                    state->handler.emplace(std::move(handler));
+                    for (auto& client : clients) {
+                        if (keep_warm) {
+                            client->set_keep_warm(true);
+                        }
+                        client->warm([state, work](http_error err) {
+                            std::unique_lock<std::mutex> lock(state->mutex);
+                            if (err && !state->err) {
+                                state->err = err;
+                            }
+                            if (--state->remaining > 0) return;
+                            auto h = std::move(*state->handler);
+                            state->handler.reset();
+                            lock.unlock();
+                            asio::dispatch(work, beast::bind_front_handler(std::move(h), state->err));
+                        });
+                    }
+                },
+                token, std::string(host), std::string(port), https, count, keep_warm);
+        }
+
+        // the request is returned as a handle, e.g. to cancel it
         template<typename response_body_type = http_binary_body, typename handler_type>
-        inline void enqueue(http_string host, http_string port, http_string path, optional<https_method> https, handler_type handler) {
+        inline http_request_ptr enqueue(http_string host, http_string port, http_string path, optional<https_method> https, handler_type handler, http_priority priority = http_priority_normal) {
             using request_type = http_request_t<http_empty_body, response_body_type, handler_type>;
-            auto req = std::make_shared<request_type>(http_verb::get, std::move(path), std::move(handler));
-            enqueue(std::move(host), std::move(port), https, std::move(req));
+            http_request_ptr req = std::allocate_shared<request_type>(http_recycling_allocator<request_type>(), http_verb::get, std::move(path), std::move(handler));
+            req->set_priority(priority);
+            enqueue(std::move(host), std::move(port), https, req);
+            return req;
         }
 
         template<typename response_body_type = http_binary_body, typename handler_type>
-        inline void enqueue(http_string host, http_string port, http_string path, std::string data, optional<https_method> https, handler_type handler) {
+        inline http_request_ptr enqueue(http_string host, http_string port, http_string path, std::string data, optional<https_method> https, handler_type handler, http_priority priority = http_priority_normal) {
             using request_type = http_request_t<http_string_body, response_body_type, handler_type>;
-            auto req = std::make_shared<request_type>(http_verb::get, std::move(path), std::move(data), std::move(handler));
-            enqueue(std::move(host), std::move(port), https, std::move(req));
+            http_request_ptr req = std::allocate_shared<request_type>(http_recycling_allocator<request_type>(), http_verb::get, std::move(path), std::move(data), std::move(handler));
+            req->set_priority(priority);
+            enqueue(std::move(host), std::move(port), https, req);
+            return req;
+        }
+
+        // completion token flavour, e.g. co_await pool.async_get<http_string_body>(host, port, path, nullopt, asio::use_awaitable)
+        // completes with void(http_error err, http_stage stage, http::response<response_body_type, http_response_fields> response)
+        template<typename response_body_type = http_binary_body, typename token_type>
+        inline auto async_enqueue(http_verb method, http_string host, http_string port, http_string path, optional<std::string> data, optional<https_method> https, token_type&& token) {
+            using response_type = http::response<response_body_type, http_response_fields>;
+            return asio::async_initiate<token_type, void(http_error, http_stage, response_type)>(
+                [this](auto handler, http_verb method, const std::string& host, const std::string& port, const std::string& path, optional<std::string> data, optional<https_method> https) {
+                    using handler_type = http_async_handler<decltype(handler), response_type>;
+                    http_request_ptr req;
+                    if (data) {
+                        using request_type = http_request_t<http_string_body, response_body_type, handler_type>;
+                        req = std::allocate_shared<request_type>(http_recycling_allocator<request_type>(), method, path, std::move(*data), handler_type(std::move(handler), executor));
+                    }
+                    else {
+                        using request_type = http_request_t<http_empty_body, response_body_type, handler_type>;
+                        req = std::allocate_shared<request_type>(http_recycling_allocator<request_type>(), method, path, handler_type(std::move(handler), executor));
+                    }
+                    enqueue(host, port, https, std::move(req));
+                },
+                token, method, std::string(host), std::string(port), std::string(path), std::move(data), https);
+        }
+
+        template<typename response_body_type = http_binary_body, typename token_type>
+        inline auto async_get(http_string host, http_string port, http_string path, optional<https_method> https, token_type&& token) {
+            return async_enqueue<response_body_type>(http_verb::get, host, port, path, nullopt, https, std::forward<token_type>(token));
+        }
+
+        template<typename response_body_type = http_binary_body, typename token_type>
+        inline auto async_post(http_string host, http_string port, http_string path, std::string data, optional<https_method> https, token_type&& token) {
+            return async_enqueue<response_body_type>(http_verb::post, host, port, path, std::move(data), https, std::forward<token_type>(token));
         }
 
         template<typename request_type>
@@ -49,50 +277,97 @@ namespace tms {
         }
 
         inline void enqueue(http_string host, http_string port, optional<https_method> https, http_request_ptr req) {
-            std::string key(host);
-            if (!port.empty()) {
-                key += ":" + std::string(port);
-            }
-    #ifndef ASIO_POOL_HTTPS_IGNORE
-            if (https) {
-                key += ":ssl" + std::to_string(*https);
+            if (serve_cached(host, port, https, req)) {
+                return;
             }
-    #endif
+            sweep();
+            auto method = https_key(https);
+            auto hash = hash_key(host, port, method);
+            auto& shard = shards[hash % shard_count];
 
             http_client_ptr client;
+            dropped_list dropped;
             {
-                std::lock_guard<std::mutex> lock(mutex);
-                auto ptr = clients.find(key);
-                if (ptr == clients.end()) {
-    #ifndef ASIO_POOL_HTTPS_IGNORE
-                    if (https) {
-                        client = std::make_shared<http_client>(make_strand(executor), host, port, *https);
-                    }
-                    else
-    #endif
-                    {
-                        client = std::make_shared<http_client>(make_strand(executor), host, port);
-                    }
-                    clients.emplace(key, clients_list{ client });
-                }
-                else {
-                    auto& list = ptr->second;
-                    size_t client_queue_size = std::numeric_limits<size_t>::max();
-                    for (auto &cur_client : list) {
-                        auto count = cur_client->queue_size();
-                        if (client_queue_size > count) {
-                            client_queue_size = count;
-                            client = cur_client;
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                auto& entry = find_host(shard, hash, host, port, method);
+                if (entry.breaker->is_open()) {
+                    return fail_fast(entry, std::move(req));
+                }
+                if (!admit(entry, overflow, dropped)) {
+                    return reject(entry, std::move(req));
+                }
+                set_deadline(req);
+                client = dispatch(entry, req);
+            }
+
+            discard(dropped);
+            if (client) {
+                client->enqueue(req);
+            }
+        }
+
+        // range of http_batch_item: grouped by host under a single lock of each shard, pushed to the host queue at once,
+        // and a single post wakes each connection taking them
+        template<typename range_type>
+        void enqueue_batch(const range_type& items) {
+            sweep();
+            std::vector<std::pair<size_t, const http_batch_item*> > keyed;
+            for (auto& item : items) {
+                if (serve_cached(item.host, item.port, item.https, item.request)) {
+                    continue;
+                }
+                keyed.emplace_back(hash_key(item.host, item.port, https_key(item.https)), &item);
+            }
+
+            // same hosts together, in order of submission
+            std::stable_sort(keyed.begin(), keyed.end(), [](const std::pair<size_t, const http_batch_item*>& a, const std::pair<size_t, const http_batch_item*>& b) {
+                auto a_shard = a.first % shard_count, b_shard = b.first % shard_count;
+                return a_shard < b_shard || (a_shard == b_shard && a.first < b.first);
+            });
+
+            std::vector<std::pair<http_client_ptr, http_request_ptr> > reserved;
+            dropped_list dropped;
+            for (size_t i = 0; i < keyed.size();) {
+                auto& shard = shards[keyed[i].first % shard_count];
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                do {
+                    auto hash = keyed[i].first;
+                    auto& first = *keyed[i].second;
+                    auto method = https_key(first.https);
+                    auto& entry = find_host(shard, hash, first.host, first.port, method);
+
+                    std::vector<http_request_ptr> shared;
+                    for (; i < keyed.size() && keyed[i].first == hash; i++) {
+                        auto& item = *keyed[i].second;
+                        if (item.https != first.https || item.host != first.host || item.port != first.port) {
+                            break;
+                        }
+                        if (entry.breaker->is_open()) {
+                            fail_fast(entry, item.request);
+                            continue;
+                        }
+                        if (!admit(entry, overflow, dropped)) {
+                            reject(entry, item.request);
+                            continue;
+                        }
+                        set_deadline(item.request);
+                        if (takes_reserved(entry, item.request)) {
+                            reserved.emplace_back(reserved_client(entry), item.request);
+                            continue;
                         }
+                        shared.push_back(item.request);
                     }
-                    if (!client || (client_queue_size > 1 && list.size() < maxcon_per_host)) {
-                        client = std::make_shared<http_client>(make_strand(executor), host, port);
-                        list.push_back(client);
+                    if (!shared.empty()) {
+                        auto woken = entry.queue->push(shared);
+                        add_clients(entry, shared.size() - woken);
                     }
-                }
+                } while (i < keyed.size() && &shards[keyed[i].first % shard_count] == &shard);
             }
 
-            client->enqueue(req);
+            discard(dropped);
+            for (auto& part : reserved) {
+                part.first->enqueue(std::move(part.second));
+            }
         }
 
         http_pool_stats get_stats() {
@@ -102,42 +377,610 @@ namespace tms {
         }
 
         bool get_stats(http_pool_stats &stats, int tmsec = 0) {
-            std::lock_guard<std::mutex> lock(mutex);
-            auto curr_time = system_clock::now();
-            auto tmout = std::chrono::duration<double>(curr_time - stats_time).count();
-            auto reset = tmout > (tmsec <= 0 ? http_timeouts::stats : tmsec);
-            if (reset) stats_time = curr_time;
-            else if (tmsec > 0) return false;
-
-            for (auto& ptr : clients) {
-                stats.host_count++;
-                for (auto& client : ptr.second) {
+            double tmout = 0;
+            bool reset = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto curr_time = system_clock::now();
+                tmout = std::chrono::duration<double>(curr_time - stats_time).count();
+                reset = tmout > (tmsec <= 0 ? http_timeouts::stats : tmsec);
+                if (reset) stats_time = curr_time;
+                else if (tmsec > 0) return false;
+            }
+
+            // shards are locked only to copy the hosts, counters are read without blocking connections
+            struct host_refs {
+                clients_list clients;
+                http_host_metrics_ptr metrics;
+                http_host_queue_ptr queue;
+                http_circuit_breaker_ptr breaker;
+            };
+            std::vector<host_refs> refs;
+            auto first = stats.hosts.size();
+            for (auto& shard : shards) {
+                std::lock_guard<std::mutex> shard_lock(shard.mutex);
+                for (auto& ptr : shard.hosts) {
+                    auto& entry = ptr.second;
+                    stats.hosts.emplace_back();
+                    auto& host = stats.hosts.back();
+                    host.host = entry.host;
+                    host.port = entry.port;
+                    host.secure = entry.method >= 0;
+                    refs.push_back(host_refs{ entry.clients, entry.metrics, entry.queue, entry.breaker });
+                    if (entry.reserved) {
+                        refs.back().clients.push_back(entry.reserved);
+                    }
+                    host.connections = refs.back().clients.size();
+                }
+            }
+            stats.host_count += refs.size();
+
+            for (size_t i = 0; i < refs.size(); i++) {
+                auto& host = stats.hosts[first + i];
+                refs[i].metrics->snapshot(host.latency, host.counters, reset);
+                stats.latency.merge(host.latency);
+                host.queue_size = refs[i].queue->size();
+                host.circuit = refs[i].breaker->state();
+                host.circuit_opened = refs[i].breaker->opened_count();
+                stats.queue_size += host.queue_size;
+                stats.dropped_count += refs[i].queue->dropped_count(reset);
+                for (auto& client : refs[i].clients) {
                     auto client_stats = client->get_stats(reset);
+                    host.queue_size += client_stats.queue_size;
                     (client_stats.state > 0 ? stats.active_count : stats.inactive_count)++;
                     stats.queue_size += client_stats.queue_size;
                     stats.error_count += client_stats.error_count;
                     stats.bytes_readed += client_stats.bytes_readed;
+                    stats.bytes_decoded += client_stats.bytes_decoded;
                     stats.bytes_written += client_stats.bytes_written;
+                    stats.handshake_count += client_stats.handshake_count;
+                    stats.handshake_resumed += client_stats.handshake_resumed;
+                    stats.dropped_count += client_stats.dropped_count;
                     stats.total_seconds += client_stats.total_seconds;
                 }
             }
+            stats.waiting_count = total_gate->waiting_count();
+            stats.connection_count = connection_gate->size();
+            stats.connection_waiting = connection_gate->waiting_count();
+            stats.rejected_count = reset ? rejected.exchange(0) : rejected.load();
+            stats.evicted_count = reset ? evicted.exchange(0) : evicted.load();
             if (stats.total_seconds > 0.) {
                 stats.bandwidth = (stats.bytes_readed + stats.bytes_written) / stats.total_seconds;
             }
             stats.interval = tmout;
+            stats.cache = cache->get_stats(reset);
             return true;
         }
 
+        // pipelining depth for connections created from now on, 1 disables pipelining
+        void set_pipeline(size_t depth) {
+            pipeline = depth;
+        }
+
+        // http/2 for connections created from now on: https hosts offer h2 by ALPN and fall back to http/1.1,
+        // http2_prior_knowledge also speaks h2c to plain http hosts
+        void set_http2(http2_mode mode) {
+            http2 = mode;
+    #ifndef ASIO_POOL_HTTPS_IGNORE
+            for (auto& shard : shards) {
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                for (auto& host : shard.hosts) {
+                    if (host.second.ssl_context) {
+                        host.second.ssl_context->offer_h2(mode != http2_off);
+                    }
+                }
+            }
+    #endif
+        }
+
+        // one more connection of each host only for interactive requests, so they never queue behind bulk transfers;
+        // while it is busy an interactive request goes to a shared connection waiting for work, if any
+        void set_priority_reserve(bool value) {
+            reserve_interactive = value;
+        }
+
+        // total deadline of requests enqueued without their own one, 0 is none
+        void set_request_timeout(std::chrono::milliseconds timeout) {
+            request_timeout = timeout.count();
+        }
+
+        // drop cached dns results, e.g. after upstream addresses changed
+        void flush_dns() {
+            dns->clear();
+        }
+
+        // GET responses kept up to the budget of bytes, served while fresh by Cache-Control or Expires without
+        // a connection and revalidated by ETag or Last-Modified when stale; 0 disables the cache
+        void set_cache(size_t budget) {
+            cache->set_budget(budget);
+        }
+
+        void flush_cache() {
+            cache->clear();
+        }
+
     private:
         system_clock::time_point stats_time = system_clock::now();
         size_t maxcon_per_host;
+        std::atomic<size_t> pipeline{ 1 };
+        std::atomic<http2_mode> http2{ http2_off };
+        std::atomic<int64_t> request_timeout{ 0 };
+        std::atomic<bool> reserve_interactive{ false };
         asio_executor executor;
+        http_resolver_cache_ptr dns;
         std::mutex mutex;
 
-        typedef std::list<http_client_ptr> clients_list;
-        typedef std::map<std::string, clients_list> clients_map;
-        clients_map clients;
+        // queue limits
+        http_queue_gate_ptr total_gate;
+        std::atomic<size_t> host_limit{ 0 };
+        std::atomic<http_overflow> overflow{ http_overflow_reject };
+        std::atomic<size_t> rejected{ 0 };
+        http_connection_gate_ptr connection_gate;
+        http_circuit_config circuit_config;
+        http_response_cache_ptr cache;
+
+        // idle eviction
+        std::atomic<steady_clock::rep> idle_timeout{ 0 };
+        std::atomic<size_t> hosts_limit{ 0 };
+        std::atomic<steady_clock::rep> next_sweep{ 0 };
+        std::atomic<size_t> sweep_index{ 0 };
+        std::atomic<size_t> evicted{ 0 };
+
+        typedef std::vector<http_client_ptr> clients_list;
+
+        // requests dropped for room under a shard lock, failed once it is unlocked
+        typedef std::vector<std::pair<http_host_queue_ptr, http_request_ptr> > dropped_list;
+
+        // clients of the same host, port and https method
+        struct host_entry {
+            std::string host, port;
+            int method;
+            clients_list clients;
+            http_client_ptr reserved;
+            http_host_queue_ptr queue;
+            steady_clock::time_point used;
+            http_queue_gate_ptr gate;
+            http_host_metrics_ptr metrics;
+            http_circuit_breaker_ptr breaker;
+            size_t warm;                // connections kept open by prewarm
+    #ifndef ASIO_POOL_HTTPS_IGNORE
+            http_ssl_context_ptr ssl_context;
+    #endif
+        };
+
+        // hosts are spread over separately locked shards by key hash,
+        // the shard map is keyed by hash so lookup needs no key string
+        struct hosts_shard {
+            std::mutex mutex;
+            std::unordered_multimap<size_t, host_entry> hosts;
+        };
+
+        static const size_t shard_count = 16;
+        hosts_shard shards[shard_count];
+
+        static int https_key(const optional<https_method>& https) {
+    #ifndef ASIO_POOL_HTTPS_IGNORE
+            if (https) {
+                return static_cast<int>(*https);
+            }
+    #endif
+            return -1;
+        }
 
+        // fresh cached response completes the request, true then
+        bool serve_cached(http_string host, http_string port, const optional<https_method>& https, const http_request_ptr& req) {
+            if (!cache->enabled()) {
+                return false;
+            }
+            std::string key(https ? "https://" : "http://");
+            key.append(host.data(), host.size()).append(":").append(port.data(), port.size());
+            auto target = req->target();
+            key.append(target.data(), target.size());
+            return cache->lookup(std::move(key), req, executor);
+        }
+
+        // FNV-1a over host, port and method
+        static size_t hash_key(http_string host, http_string port, int method) {
+            uint64_t hash = 14695981039346656037ULL;
+            auto append = [&hash](http_string str) {
+                for (auto ch : str) {
+                    hash = (hash ^ static_cast<unsigned char>(ch)) * 1099511628211ULL;
+                }
+                hash = (hash ^ 0xff) * 1099511628211ULL;
+            };
+            append(host);
+            append(port);
+            hash = (hash ^ static_cast<uint64_t>(method + 1)) * 1099511628211ULL;
+            return static_cast<size_t>(hash);
+        }
+
+        // shard must be locked
+        host_entry& find_host(hosts_shard& shard, size_t hash, http_string host, http_string port, int method) {
+            auto range = shard.hosts.equal_range(hash);
+            for (auto ptr = range.first; ptr != range.second; ++ptr) {
+                auto& entry = ptr->second;
+                if (entry.method == method && http_string(entry.host) == host && http_string(entry.port) == port) {
+                    entry.used = steady_clock::now();
+                    return entry;
+                }
+            }
+            auto gate = std::make_shared<http_queue_gate>(host_limit);
+            auto metrics = std::make_shared<http_host_metrics>();
+            auto queue = std::make_shared<http_host_queue>(executor, gate, total_gate, metrics);
+            http_circuit_breaker_ptr breaker;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                breaker = std::make_shared<http_circuit_breaker>(circuit_config);
+            }
+            auto& entry = shard.hosts.emplace(hash, host_entry{ std::string(host), std::string(port), method, {}, nullptr, queue, steady_clock::now(), gate, metrics, breaker, 0 })->second;
+    #ifndef ASIO_POOL_HTTPS_IGNORE
+            if (method >= 0) {
+                entry.ssl_context = std::make_shared<http_ssl_context>(static_cast<https_method>(method));
+                if (http2 != http2_off) {
+                    entry.ssl_context->offer_h2(true);
+                }
+            }
+    #endif
+            return entry;
+        }
+
+        // the request goes to the host queue and a connection waiting for work takes it, while none waits
+        // a new one joins up to maxcon_per_host; the reserved connection is returned for interactive requests,
+        // shard must be locked
+        http_client_ptr dispatch(host_entry& entry, const http_request_ptr& req) {
+            if (takes_reserved(entry, req)) {
+                return reserved_client(entry);
+            }
+            if (!entry.queue->push(req)) {
+                add_clients(entry, 1);
+            }
+            return nullptr;
+        }
+
+        // connections pulling from the host queue, a host known to speak h2 gets a single one, shard must be locked
+        void add_clients(host_entry& entry, size_t count) {
+            if (!entry.clients.empty() && expects_h2(entry)) return;
+            for (; count > 0 && entry.clients.size() < maxcon_per_host; count--) {
+                auto client = make_client(entry);
+                client->set_host_queue(entry.queue);
+                entry.clients.push_back(client);
+                client->pull();
+            }
+        }
+
+        // by prior knowledge, or ALPN of the last connection to the host
+        bool expects_h2(const host_entry& entry) {
+    #ifndef ASIO_POOL_HTTPS_IGNORE
+            if (entry.ssl_context) {
+                return http2 != http2_off && entry.ssl_context->agreed_h2.load(std::memory_order_relaxed);
+            }
+    #endif
+            return http2 == http2_prior_knowledge;
+        }
+
+        // an interactive request takes the reserved connection unless its pending requests would hold it up
+        // while a shared connection is idle, the host queue serves interactive ones first; shard must be locked
+        bool takes_reserved(host_entry& entry, const http_request_ptr& req) {
+            if (!reserve_interactive || req->priority() != http_priority_interactive) {
+                return false;
+            }
+            return !entry.reserved || entry.reserved->queue_size() == 0 || !entry.queue->has_waiting();
+        }
+
+        // shard must be locked
+        http_client_ptr reserved_client(host_entry& entry) {
+            if (!entry.reserved) {
+                entry.reserved = make_client(entry);
+            }
+            return entry.reserved;
+        }
+
+        // host entry's shard must be locked
+        http_client_ptr make_client(host_entry& entry) {
+            http_client_ptr client;
+    #ifndef ASIO_POOL_HTTPS_IGNORE
+            if (entry.ssl_context) {
+                client = std::make_shared<http_ssl_client>(make_strand(executor), entry.host, entry.port, entry.ssl_context, dns);
+            }
+            else
+    #endif
+            {
+                client = std::make_shared<http_tcp_client>(make_strand(executor), entry.host, entry.port, dns);
+            }
+            client->set_pipeline(pipeline);
+            client->set_http2(http2);
+            client->set_gates(entry.gate, total_gate);
+            client->set_metrics(entry.metrics);
+            client->set_breaker(entry.breaker);
+            client->set_connection_gate(connection_gate, entry.gate.get());
+            return client;
+        }
+
+        // take room for a request in the host and pool queues, host entry's shard must be locked;
+        // nothing is released here, as waiters run inline from a release and take shard locks: the host gate
+        // is only acquired under this lock, so its room is checked first and the pool gate is never given back,
+        // a request dropped for room goes to the list, the caller discards them once unlocked
+        bool admit(host_entry& entry, http_overflow policy, dropped_list& dropped) {
+            if (entry.gate->has_room() && total_gate->try_acquire()) {
+                entry.gate->acquire();
+                return true;
+            }
+            if (policy != http_overflow_drop_oldest) {
+                return false;
+            }
+
+            // the host queue, or else the most loaded connection of the host gives up its oldest unsent request,
+            // the new one is queued over the limit till then
+            if (auto req = entry.queue->remove_oldest()) {
+                dropped.emplace_back(entry.queue, std::move(req));
+                total_gate->acquire();
+                entry.gate->acquire();
+                return true;
+            }
+            http_client_ptr busiest;
+            size_t count = 0;
+            for (auto& client : entry.clients) {
+                auto size = client->queue_size();
+                if (size > count) {
+                    count = size;
+                    busiest = client;
+                }
+            }
+            if (!busiest) {
+                return false;
+            }
+            busiest->drop_oldest();
+            total_gate->acquire();
+            entry.gate->acquire();
+            return true;
+        }
+
+        // the dropped requests release their gates, waiters may enqueue again, so no shard is locked
+        void discard(dropped_list& dropped) {
+            for (auto& part : dropped) {
+                part.first->discard(part.second, http_pool_errc::dropped);
+            }
+        }
+
+        void set_deadline(const http_request_ptr& req) {
+            auto timeout = request_timeout.load(std::memory_order_relaxed);
+            if (timeout > 0 && req->expiry() == steady_clock::time_point()) {
+                req->expires_after(std::chrono::milliseconds(timeout));
+            }
+        }
+
+        void reject(host_entry& entry, http_request_ptr req) {
+            rejected++;
+            entry.metrics->rejected.fetch_add(1, std::memory_order_relaxed);
+            asio::post(executor, [req]() {
+                req->end(http_pool_errc::queue_full, http_stage_none);
+            });
+        }
+
+        // one shard per idle_timeout / shard_count (at least 100ms), by the caller that wins the turn
+        void sweep() {
+            auto idle = idle_timeout.load(std::memory_order_relaxed);
+            if (idle <= 0 && hosts_limit.load(std::memory_order_relaxed) == 0) {
+                return;
+            }
+            auto now = steady_clock::now();
+            auto next = next_sweep.load(std::memory_order_relaxed);
+            if (now.time_since_epoch().count() < next) {
+                return;
+            }
+            auto interval = std::max<steady_clock::rep>(idle / shard_count, std::chrono::duration_cast<steady_clock::duration>(std::chrono::milliseconds(100)).count());
+            if (!next_sweep.compare_exchange_strong(next, now.time_since_epoch().count() + interval)) {
+                return;
+            }
+            evict(shards[sweep_index++ % shard_count], now);
+        }
+
+        // removal under the shard lock is safe against enqueue: a retired client woken just before still serves
+        // what it takes from the host queue, hosts with queued requests stay, gates and metrics are shared
+        void evict(hosts_shard& shard, steady_clock::time_point now) {
+            auto idle = steady_clock::duration(idle_timeout.load(std::memory_order_relaxed));
+            auto limit = hosts_limit.load(std::memory_order_relaxed);
+            clients_list closed;
+            {
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                if (idle > steady_clock::duration::zero()) {
+                    for (auto ptr = shard.hosts.begin(); ptr != shard.hosts.end();) {
+                        if (ptr->second.warm > 0) {
+                            ++ptr;
+                            continue;
+                        }
+                        auto& list = ptr->second.clients;
+                        for (auto client = list.begin(); client != list.end();) {
+                            if ((*client)->idle_time(now) > idle) {
+                                closed.push_back(std::move(*client));
+                                client = list.erase(client);
+                            }
+                            else ++client;
+                        }
+                        auto& reserved = ptr->second.reserved;
+                        if (reserved && reserved->idle_time(now) > idle) {
+                            closed.push_back(std::move(reserved));
+                            reserved.reset();
+                        }
+                        if (list.empty() && !reserved && ptr->second.queue->size() == 0 && now - ptr->second.used > idle) ptr = shard.hosts.erase(ptr);
+                        else ++ptr;
+                    }
+                }
+
+                // least recently used hosts over the shard's part of the limit
+                auto shard_limit = (limit + shard_count - 1) / shard_count;
+                if (limit > 0 && shard.hosts.size() > shard_limit) {
+                    typedef decltype(shard.hosts.begin()) host_ptr;
+                    std::vector<std::pair<steady_clock::time_point, host_ptr> > unused;
+                    for (auto ptr = shard.hosts.begin(); ptr != shard.hosts.end(); ++ptr) {
+                        auto& list = ptr->second.clients;
+                        auto& reserved = ptr->second.reserved;
+                        if (ptr->second.warm == 0 && (!reserved || reserved->queue_size() == 0) && ptr->second.queue->size() == 0 && std::all_of(list.begin(), list.end(), [](const http_client_ptr& client) { return client->queue_size() == 0; })) {
+                            unused.emplace_back(ptr->second.used, ptr);
+                        }
+                    }
+                    auto count = std::min(shard.hosts.size() - shard_limit, unused.size());
+                    auto older = [](const std::pair<steady_clock::time_point, host_ptr>& a, const std::pair<steady_clock::time_point, host_ptr>& b) {
+                        return a.first < b.first;
+                    };
+                    std::nth_element(unused.begin(), unused.begin() + count, unused.end(), older);
+                    for (size_t i = 0; i < count; i++) {
+                        auto& entry = unused[i].second->second;
+                        closed.insert(closed.end(), entry.clients.begin(), entry.clients.end());
+                        if (entry.reserved) {
+                            closed.push_back(entry.reserved);
+                        }
+                        shard.hosts.erase(unused[i].second);
+                    }
+                }
+            }
+
+            evicted += closed.size();
+            for (auto& client : closed) {
+                client->retire();
+            }
+        }
+
+        void fail_fast(host_entry& entry, http_request_ptr req) {
+            entry.metrics->complete(http_pool_errc::circuit_open, http_stage_none, 0);
+            asio::post(executor, [req]() {
+                req->end(http_pool_errc::circuit_open, http_stage_none);
+            });
+        }
+
+        // enqueue without overflow policy, false if there is no room
+        bool try_enqueue(http_string host, http_string port, optional<https_method> https, const http_request_ptr& req) {
+            if (serve_cached(host, port, https, req)) {
+                return true;
+            }
+            sweep();
+            auto method = https_key(https);
+            auto hash = hash_key(host, port, method);
+            auto& shard = shards[hash % shard_count];
+
+            http_client_ptr client;
+            dropped_list dropped;
+            {
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                auto& entry = find_host(shard, hash, host, port, method);
+                if (entry.breaker->is_open()) {
+                    fail_fast(entry, req);
+                    return true;
+                }
+                if (!admit(entry, http_overflow_reject, dropped)) {
+                    return false;
+                }
+                set_deadline(req);
+                client = dispatch(entry, req);
+            }
+            discard(dropped);
+            if (client) {
+                client->enqueue(req);
+            }
+            return true;
+        }
     };
 
+    //---------------------------------------------------------------------------------------------
+    // prometheus text format of the pool stats: host counters are monotonic,
+    // latency summaries (quantiles, sum and count) and gauges cover the last stats interval
+
+    inline std::string prometheus_label(const std::string& value) {
+        std::string result;
+        for (auto c : value) {
+            if (c == '\\' || c == '"') result += '\\';
+            if (c == '\n') { result += "\\n"; continue; }
+            result += c;
+        }
+        return result;
+    }
+
+    inline void write_prometheus(std::ostream& out, const http_pool_stats& stats, const std::string& prefix = "http_pool") {
+        static const char* stages[] = { "none", "resolve", "connect", "handshake", "write", "read" };
+        static const char* timings[] = { "queue", "resolve", "connect", "handshake", "write", "first_byte", "read", "total" };
+        static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+        auto family = [&](const char* name, const char* type, const char* help) {
+            out << "# HELP " << prefix << "_" << name << " " << help << "\n";
+            out << "# TYPE " << prefix << "_" << name << " " << type << "\n";
+        };
+        auto labels = [](const http_host_stats& host) {
+            return "host=\"" + prometheus_label(host.host) + "\",port=\"" + prometheus_label(host.port) + "\",scheme=\"" + (host.secure ? "https" : "http") + "\"";
+        };
+        auto counter = [&](const char* name, const char* help, size_t http_counters_stats::* field) {
+            family(name, "counter", help);
+            for (auto& host : stats.hosts) {
+                out << prefix << "_" << name << "{" << labels(host) << "} " << host.counters.*field << "\n";
+            }
+        };
+        auto latency = [&](const http_latency_stats& latency, const std::string& host_labels) {
+            auto name = prefix + (host_labels.empty() ? "_latency_seconds" : "_host_latency_seconds");
+            for (size_t i = 0; i < http_timing_count; i++) {
+                auto& timing = latency.timings[i];
+                if (timing.count() == 0) continue;
+                auto stage = host_labels + (host_labels.empty() ? "" : ",") + "stage=\"" + timings[i] + "\"";
+                for (auto q : quantiles) {
+                    out << name << "{" << stage << ",quantile=\"" << q << "\"} " << timing.percentile(q) << "\n";
+                }
+                out << name << "_sum{" << stage << "} " << timing.sum() << "\n";
+                out << name << "_count{" << stage << "} " << timing.count() << "\n";
+            }
+        };
+
+        family("hosts", "gauge", "Known hosts.");
+        out << prefix << "_hosts " << stats.host_count << "\n";
+        family("connections", "gauge", "Connections by state of the last request.");
+        out << prefix << "_connections{state=\"active\"} " << stats.active_count << "\n";
+        out << prefix << "_connections{state=\"inactive\"} " << stats.inactive_count << "\n";
+        family("queue_size", "gauge", "Queued requests.");
+        out << prefix << "_queue_size " << stats.queue_size << "\n";
+        family("waiting", "gauge", "Producers waiting for room in the queue.");
+        out << prefix << "_waiting " << stats.waiting_count << "\n";
+
+        family("host_connections", "gauge", "Connections of the host.");
+        for (auto& host : stats.hosts) {
+            out << prefix << "_host_connections{" << labels(host) << "} " << host.connections << "\n";
+        }
+        family("host_queue_size", "gauge", "Queued requests of the host.");
+        for (auto& host : stats.hosts) {
+            out << prefix << "_host_queue_size{" << labels(host) << "} " << host.queue_size << "\n";
+        }
+        family("host_circuit_state", "gauge", "Circuit breaker of the host: 0 closed, 1 open, 2 half open.");
+        for (auto& host : stats.hosts) {
+            out << prefix << "_host_circuit_state{" << labels(host) << "} " << static_cast<int>(host.circuit) << "\n";
+        }
+
+        counter("requests_total", "Completed requests, successful or not.", &http_counters_stats::requests);
+        family("errors_total", "counter", "Failed requests by stage, none is failed by the pool itself.");
+        for (auto& host : stats.hosts) {
+            for (size_t i = 0; i < http_stage_complete; i++) {
+                out << prefix << "_errors_total{" << labels(host) << ",stage=\"" << stages[i] << "\"} " << host.counters.errors[i] << "\n";
+            }
+        }
+        family("responses_total", "counter", "Responses by status class.");
+        for (auto& host : stats.hosts) {
+            for (size_t i = 0; i < 5; i++) {
+                out << prefix << "_responses_total{" << labels(host) << ",code=\"" << i + 1 << "xx\"} " << host.counters.statuses[i] << "\n";
+            }
+        }
+        counter("written_bytes_total", "Bytes written.", &http_counters_stats::bytes_written);
+        counter("read_bytes_total", "Bytes read.", &http_counters_stats::bytes_readed);
+        counter("decoded_bytes_total", "Bytes read, compressed bodies counted as decoded.", &http_counters_stats::bytes_decoded);
+        counter("connects_total", "Established connections.", &http_counters_stats::connects);
+        counter("retries_total", "Requests sent again after connection failure.", &http_counters_stats::retries);
+        counter("rejected_total", "Requests rejected by the queue limit.", &http_counters_stats::rejected);
+        counter("dropped_total", "Requests dropped from the full queue.", &http_counters_stats::dropped);
+        family("circuit_opened_total", "counter", "Times the circuit breaker of the host opened.");
+        for (auto& host : stats.hosts) {
+            out << prefix << "_circuit_opened_total{" << labels(host) << "} " << host.circuit_opened << "\n";
+        }
+
+        family("latency_seconds", "summary", "Latency of all hosts by stage.");
+        latency(stats.latency, std::string());
+        family("host_latency_seconds", "summary", "Latency of the host by stage.");
+        for (auto& host : stats.hosts) {
+            latency(host.latency, labels(host));
+        }
+    }
+
 }
@@ -3,50 +3,324 @@
 
 namespace tms {
 
+#ifndef ASIO_POOL_HTTPS_IGNORE
     //---------------------------------------------------------------------------------------------
-    // ugly http or https stream
+    // ssl context shared by connections to the same host, keeps the last client session to resume
 
-    struct http_stream {
-        using tcp_stream_type = beast::tcp_stream;
-        optional<tcp_stream_type> tcp;
-#ifndef ASIO_POOL_HTTPS_IGNORE
-        using ssl_stream_type = beast::ssl_stream<tcp_stream_type>;
-        optional<asio::ssl::context> ssl_context;
-        optional<ssl_stream_type> ssl;
-#endif
+    class http_ssl_context {
+    public:
+        asio::ssl::context context;
 
-        inline tcp_stream_type* get() {
-#ifndef ASIO_POOL_HTTPS_IGNORE
-            if (ssl) {
-                return &beast::get_lowest_layer(*ssl);
+        explicit http_ssl_context(https_method method)
+            : context(method)
+        {
+            context.set_verify_mode(asio::ssl::verify_peer);
+            context.set_default_verify_paths();
+            // load_root_certificates(context);
+
+            // sessions (and tls 1.3 tickets arriving after handshake) are passed to on_session
+            auto ctx = context.native_handle();
+            SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+            SSL_CTX_set_ex_data(ctx, ex_index(), this);
+            SSL_CTX_sess_set_new_cb(ctx, &http_ssl_context::on_session);
+        }
+
+        ~http_ssl_context() {
+            if (session) {
+                SSL_SESSION_free(session);
             }
-#endif
-            if (tcp) {
-                return &*tcp;
+        }
+
+        http_ssl_context(const http_ssl_context&) = delete;
+        http_ssl_context& operator=(const http_ssl_context&) = delete;
+
+        // offer h2 by ALPN before http/1.1, set before connections are made
+        void offer_h2(bool value) {
+            if (value) {
+                SSL_CTX_set_alpn_protos(context.native_handle(), reinterpret_cast<const unsigned char*>("\x02h2\x08http/1.1"), 12);
+            }
+            else {
+                SSL_CTX_set_alpn_protos(context.native_handle(), nullptr, 0);
             }
-            return nullptr;
         }
 
-#ifndef ASIO_POOL_HTTPS_IGNORE
-        void configure(https_method _method) {
-            ssl_context.emplace(_method);
-            ssl_context->set_verify_mode(asio::ssl::verify_peer);
-            ssl_context->set_default_verify_paths();
-            // load_root_certificates(ssl_context);
+        // the last connection agreed h2, the next ones expect it before their handshake
+        std::atomic<bool> agreed_h2{ false };
+
+        // offer the last session for resumption
+        void resume(SSL* ssl) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (session && SSL_SESSION_is_resumable(session)) {
+                SSL_set_session(ssl, session);
+            }
         }
-#endif
 
-        void init(const asio_executor& ex) {
-#ifndef ASIO_POOL_HTTPS_IGNORE
-            if (ssl_context) {
-                ssl.emplace(ex, *ssl_context);
-                tcp.reset();
-                return;
+    private:
+        std::mutex mutex;
+        SSL_SESSION* session = nullptr;
+
+        static int ex_index() {
+            static int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+            return index;
+        }
+
+        static int on_session(SSL* ssl, SSL_SESSION* sess) {
+            auto self = static_cast<http_ssl_context*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ex_index()));
+            if (!self) {
+                return 0;
             }
-            ssl.reset();
+            std::lock_guard<std::mutex> lock(self->mutex);
+            if (self->session) {
+                SSL_SESSION_free(self->session);
+            }
+            self->session = sess;
+            return 1;
+        }
+    };
+
+    typedef std::shared_ptr<http_ssl_context> http_ssl_context_ptr;
 #endif
-            tcp.emplace(ex);
+
+    //---------------------------------------------------------------------------------------------
+    // connect racing the endpoints (RFC 8305): the preferred one first, then address families interleaved,
+    // a new attempt starts every attempt_delay or as soon as the previous one fails, the first connected
+    // socket goes to the stream and the rest are closed
+
+    class http_connect_race :
+        public std::enable_shared_from_this<http_connect_race>
+    {
+    public:
+        typedef std::function<void(http_error, tcp_endpoint)> handler_type;
+        static constexpr int attempt_delay = 250;   // milliseconds, taken by value only: c++14 has no inline variables
+
+        http_connect_race(tcp_stream& _stream, std::vector<tcp_endpoint> _endpoints, handler_type h)
+            : stream(&_stream), executor(_stream.get_executor()), timer(executor), expiry(executor), endpoints(std::move(_endpoints)), handler(std::move(h))
+        {}
+
+        // preferred endpoint first, then families interleaved starting with the family resolved first
+        static std::vector<tcp_endpoint> order(const tcp_endpoints& results, const tcp_endpoint& preferred) {
+            std::vector<tcp_endpoint> first, second, result;
+            auto found = false;
+            for (auto& entry : results) {
+                auto endpoint = entry.endpoint();
+                if (endpoint == preferred) {
+                    found = true;
+                    continue;
+                }
+                auto primary = first.empty() || first.front().address().is_v6() == endpoint.address().is_v6();
+                (primary ? first : second).push_back(endpoint);
+            }
+            if (found) {
+                result.push_back(preferred);
+            }
+            for (size_t i = 0; i < first.size() || i < second.size(); i++) {
+                if (i < first.size()) result.push_back(first[i]);
+                if (i < second.size()) result.push_back(second[i]);
+            }
+            return result;
+        }
+
+        void start(steady_clock::time_point until) {
+            auto self = shared_from_this();
+            expiry.expires_at(until);
+            expiry.async_wait([self](http_error err) {
+                if (!err) self->finish(beast::error::timeout, tcp_endpoint());
+            });
+            attempt();
+        }
+
+        // the stream goes away, the handler is posted with operation_aborted
+        void cancel() {
+            if (!handler) return;
+            auto h = std::move(handler);
+            handler = nullptr;
+            stream = nullptr;
+            close();
+            asio::post(executor, std::bind(std::move(h), http_error(asio::error::operation_aborted), tcp_endpoint()));
         }
+
+    private:
+        tcp_stream* stream;
+        asio_io_executor executor;
+        asio_timer timer;
+        asio_timer expiry;
+        std::vector<tcp_endpoint> endpoints;
+        std::vector<std::unique_ptr<tcp_socket> > sockets;
+        handler_type handler;
+        size_t next = 0;
+        size_t running = 0;
+        http_error last_error;
+
+        void attempt() {
+            if (!handler || next >= endpoints.size()) return;
+            auto index = next++;
+            sockets.emplace_back(new tcp_socket(executor));
+            auto socket = sockets.back().get();
+            auto self = shared_from_this();
+            running++;
+            socket->async_connect(endpoints[index], [self, index, socket](http_error err) {
+                self->on_connect(err, index, socket);
+            });
+            if (next < endpoints.size()) {
+                timer.expires_after(std::chrono::milliseconds(int(attempt_delay)));
+                timer.async_wait([self](http_error err) {
+                    if (!err) self->attempt();
+                });
+            }
+        }
+
+        void on_connect(http_error err, size_t index, tcp_socket* socket) {
+            running--;
+            if (!handler) return;
+            if (!err) {
+                stream->socket() = std::move(*socket);
+                return finish(err, endpoints[index]);
+            }
+            last_error = err;
+            if (next < endpoints.size()) {
+                attempt();
+            }
+            else if (running == 0) {
+                finish(last_error, tcp_endpoint());
+            }
+        }
+
+        void finish(http_error err, tcp_endpoint endpoint) {
+            if (!handler) return;
+            auto h = std::move(handler);
+            handler = nullptr;
+            stream = nullptr;
+            close();
+            h(err, endpoint);
+        }
+
+        void close() {
+            http_error ignored;
+            timer.cancel();
+            expiry.cancel();
+            for (auto& socket : sockets) {
+                socket->close(ignored);
+            }
+        }
+    };
+
+    //---------------------------------------------------------------------------------------------
+    // read and write timeout of a connection: one timer waits for the expiry, it is armed again only when it
+    // fires before the expiry set last or the expiry moves before it, so the requests of a busy connection start
+    // no timer operation; operations pending at the expiry are cancelled and end with beast::error::timeout
+
+    class http_stream_timeout :
+        public std::enable_shared_from_this<http_stream_timeout>
+    {
+    public:
+        explicit http_stream_timeout(const asio_strand& ex)
+            : timer(ex)
+        {}
+
+        // socket of a new connection, or null
+        void attach(tcp_socket* s) {
+            socket = s;
+            timed_out = false;
+        }
+
+        void expires_at(steady_clock::time_point at) {
+            expiry = at;
+            timed_out = false;
+            if (at < armed) {
+                arm(at);
+            }
+        }
+
+        void expires_never() {
+            expiry = never();
+            timed_out = false;
+        }
+
+        // the connection goes away, its wait does not keep the executor busy
+        void cancel() {
+            socket = nullptr;
+            expiry = armed = never();
+            timer.cancel();
+        }
+
+        http_error result(http_error err) const {
+            return timed_out && err == asio::error::operation_aborted ? http_error(beast::error::timeout) : err;
+        }
+
+    private:
+        asio_timer timer;
+        tcp_socket* socket = nullptr;
+        steady_clock::time_point expiry = never();
+        steady_clock::time_point armed = never();
+        bool timed_out = false;
+
+        static steady_clock::time_point never() {
+            return steady_clock::time_point::max();
+        }
+
+        // a wait replaced by a new one is stale, even if it has fired already
+        void arm(steady_clock::time_point at) {
+            armed = at;
+            timer.expires_at(at);
+            std::weak_ptr<http_stream_timeout> weak = shared_from_this();
+            timer.async_wait([weak, at](http_error err) {
+                auto self = weak.lock();
+                if (!err && self && self->armed == at) {
+                    self->on_timer();
+                }
+            });
+        }
+
+        void on_timer() {
+            armed = never();
+            if (expiry == never()) return;
+            if (expiry > steady_clock::now()) {
+                return arm(expiry);
+            }
+            expiry = never();
+            if (socket) {
+                http_error ignored;
+                timed_out = true;
+                socket->cancel(ignored);
+            }
+        }
+    };
+
+    //---------------------------------------------------------------------------------------------
+    // http or https stream, chosen at compile time by the client type; pending operations hold the layer,
+    // so a dropped connection is closed at once and freed when the last of them completes
+
+    template<typename layer_type>
+    struct http_stream_t {
+        using tcp_stream_type = tcp_stream;
+        std::shared_ptr<layer_type> layer;
+
+        // read buffer lives with the connection, it may hold the beginning of the next pipelined response
+        beast::flat_buffer buffer;
+        unsigned int timeout = 0;
+        steady_clock::time_point deadline;
+        std::shared_ptr<http_stream_timeout> watch;
+        std::shared_ptr<http_connect_race> race;
+
+        inline tcp_stream_type* get() {
+            if (layer) {
+                return &beast::get_lowest_layer(*layer);
+            }
+            return nullptr;
+        }
+
+        bool resumed() {
+            return false;
+        }
+        // h2 agreed by ALPN
+        bool alpn_h2() {
+            return false;
+        }
+        // h2 agreed by the last connection to the host
+        bool expects_h2() {
+            return false;
+        }
+        void remember_h2(bool) {}
         bool valid() {
             if (auto stream = get()) {
                 auto& socket = stream->socket();
@@ -54,59 +328,362 @@ namespace tms {
             }
             return false;
         }
-        void expires_after(unsigned int secs) {
+        // stage timeout, cut by the deadline of the request if any
+        void expires_after(unsigned int secs, steady_clock::time_point until = steady_clock::time_point()) {
+            timeout = secs;
+            deadline = until;
+            extend();
+        }
+        // restart the last timeout, e.g. for the next part of long response
+        void extend() {
+            if (watch) {
+                auto at = steady_clock::now() + std::chrono::seconds(timeout);
+                watch->expires_at(deadline != steady_clock::time_point() && deadline < at ? deadline : at);
+            }
+        }
+        // e.g. an http/2 connection, its streams have their own timeouts
+        void expires_never() {
+            if (watch) {
+                watch->expires_never();
+            }
+        }
+        // an operation cancelled at its timeout ends with beast::error::timeout
+        http_error result(http_error err) const {
+            return watch ? watch->result(err) : err;
+        }
+        // the layer an operation is started on and holds, null if the connection is dropped
+        std::shared_ptr<layer_type> current_layer() {
+            return layer;
+        }
+        // call f with the stream, false if not initialized
+        template<typename F>
+        bool visit(F&& f) {
+            if (layer) {
+                f(*layer);
+                return true;
+            }
+            return false;
+        }
+        // a single endpoint is connected as is, several ones race
+        template<typename handler_type>
+        void connect(const tcp_endpoints& endpoints, const tcp_endpoint& preferred, handler_type&& handler) {
             if (auto stream = get()) {
-                stream->expires_after(std::chrono::seconds(secs));
+                if (endpoints.size() < 2) {
+                    stream->async_connect(endpoints, std::forward<handler_type>(handler));
+                    return;
+                }
+                auto until = steady_clock::now() + std::chrono::seconds(timeout);
+                if (deadline != steady_clock::time_point() && deadline < until) {
+                    until = deadline;
+                }
+                race = std::make_shared<http_connect_race>(*stream, http_connect_race::order(endpoints, preferred), std::forward<handler_type>(handler));
+                race->start(until);
             }
         }
-        void connect(const tcp_endpoints& endpoints, std::function<void(http_error err, tcp_endpoint endpoint)>&& handler) {
+        // clean close, the peer may have closed it already
+        void shutdown() {
             if (auto stream = get()) {
-                stream->async_connect(endpoints, std::move(handler));
-                /*
-                stream->async_connect(endpoints, [h = std::move(handler)](http_error err, tcp_endpoint endpoint) {
-                    h(err, endpoint);
-                });
-                */
+                http_error ignored;
+                stream->socket().shutdown(tcp_socket::shutdown_both, ignored);
+            }
+        }
+        // pending operations complete with operation_aborted
+        void reset() {
+            if (race) {
+                race->cancel();
+                race.reset();
+            }
+            buffer.consume(buffer.size());
+            if (watch) {
+                watch->cancel();
+            }
+            if (auto stream = get()) {
+                stream->close();
+            }
+            layer.reset();
+        }
+
+    protected:
+        // the timeout of the connection just made, its timer is kept for the next ones
+        void watch_layer(const asio_strand& ex) {
+            if (!watch) {
+                watch = std::make_shared<http_stream_timeout>(ex);
             }
+            watch->attach(&get()->socket());
+        }
+    };
+
+    struct http_tcp_stream : http_stream_t<tcp_stream> {
+        static const bool secure = false;
+
+        void init(const asio_strand& ex) {
+            buffer.consume(buffer.size());
+            layer = std::make_shared<tcp_stream>(ex);
+            watch_layer(ex);
         }
+    };
+
 #ifndef ASIO_POOL_HTTPS_IGNORE
-        void handshake(const std::string& hostname, std::function<void(http_error err)>&& handler) {
-            if (ssl) {
+    struct http_ssl_stream : http_stream_t<beast::ssl_stream<tcp_stream> > {
+        using ssl_stream_type = beast::ssl_stream<tcp_stream_type>;
+        static const bool secure = true;
+        http_ssl_context_ptr ssl_context;
+
+        void configure(https_method _method) {
+            ssl_context = std::make_shared<http_ssl_context>(_method);
+        }
+        void configure(http_ssl_context_ptr _context) {
+            ssl_context = std::move(_context);
+        }
+        bool resumed() {
+            return layer && SSL_session_reused(layer->native_handle()) != 0;
+        }
+        bool alpn_h2() {
+            if (!layer) return false;
+            const unsigned char* protocol = nullptr;
+            unsigned int size = 0;
+            SSL_get0_alpn_selected(layer->native_handle(), &protocol, &size);
+            return size == 2 && protocol[0] == 'h' && protocol[1] == '2';
+        }
+        bool expects_h2() {
+            return ssl_context && ssl_context->agreed_h2.load(std::memory_order_relaxed);
+        }
+        void remember_h2(bool value) {
+            if (ssl_context) {
+                ssl_context->agreed_h2.store(value, std::memory_order_relaxed);
+            }
+        }
+        void init(const asio_strand& ex) {
+            buffer.consume(buffer.size());
+            layer = std::make_shared<ssl_stream_type>(ex, ssl_context->context);
+            watch_layer(ex);
+        }
+        template<typename handler_type>
+        void handshake(const std::string& hostname, handler_type&& handler) {
+            if (layer) {
                 // error after handshake [asio.ssl:369098857] unregistered scheme (STORE routines)
-                // ssl->set_verify_mode(asio::ssl::verify_peer);
-                // ssl->set_verify_callback(asio::ssl::host_name_verification(hostname));
-                if (!SSL_set_tlsext_host_name(ssl->native_handle(), hostname.c_str())) {
+                // layer->set_verify_mode(asio::ssl::verify_peer);
+                // layer->set_verify_callback(asio::ssl::host_name_verification(hostname));
+                if (!SSL_set_tlsext_host_name(layer->native_handle(), hostname.c_str())) {
                     return handler(http_error{ static_cast<int>(::ERR_get_error()), asio::error::get_ssl_category() });
                 }
-                ssl->async_handshake(ssl_stream_type::client, std::move(handler));
+                ssl_context->resume(layer->native_handle());
+                layer->async_handshake(ssl_stream_type::client, [keep = layer, h = std::forward<handler_type>(handler)](http_error err) mutable {
+                    h(err);
+                });
             }
         }
-#endif
+        // closing without ssl shutdown would mark the session as not resumable, a failed connection does not keep it
         void shutdown() {
-            if (auto stream = get()) {
-                stream->socket().shutdown(tcp::socket::shutdown_both);
+            if (layer && SSL_is_init_finished(layer->native_handle())) {
+                SSL_set_shutdown(layer->native_handle(), SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
             }
+            http_stream_t::shutdown();
         }
-        void reset() {
-            tcp.reset();
-#ifndef ASIO_POOL_HTTPS_IGNORE
-            ssl.reset();
+    };
 #endif
+    
+    //---------------------------------------------------------------------------------------------
+    // request attributes seen by connections, queues and the response cache
+
+    class http_request;
+    class http2_stream;
+
+    // priority classes, a queued request goes ahead of the unsent ones of a lower class
+    enum http_priority {
+        http_priority_interactive = 0,
+        http_priority_normal = 1,
+        http_priority_bulk = 2
+    };
+
+    // time points of a request for the latency stats
+    struct http_request_timing {
+        steady_clock::time_point queued;
+        steady_clock::time_point sent;
+        steady_clock::time_point written;
+        steady_clock::time_point header;
+    };
+
+    // body bytes of a response with content coding as read and as decoded, both 0 without decoding
+    struct http_decoded_size {
+        size_t encoded = 0;
+        size_t decoded = 0;
+    };
+
+    // request and response header fields live as long as the request, recycled with it
+    typedef http::basic_fields<http_recycling_allocator<char> > http_request_fields;
+    typedef http::basic_fields<http_recycling_allocator<char> > http_response_fields;
+
+    // response kept by the cache, header and body bytes
+    struct http_cached_response {
+        http::response_header<http_response_fields> header;
+        std::string body;
+    };
+
+    // response cache waiting for the response of a request, it stores the response or completes a 304 one
+    // with the cached body before the handler gets it
+    class http_cache_link {
+    public:
+        virtual ~http_cache_link() {}
+        virtual void on_response(http_request& req, http_error err) = 0;
+    };
+
+    // connection or queue holding the request
+    class http_request_owner {
+    public:
+        virtual ~http_request_owner() {}
+        // may be called from any thread
+        virtual void on_cancel(http_request* req) = 0;
+    };
+
+    class http_process_target : public http_request_owner {
+    public:
+        virtual void on_process(unsigned int gen, http_stage stage, http_error err, size_t transferred) = 0;
+    };
+
+    // write/read completion passed to beast as is: no type erasure per operation,
+    // operation state is allocated by the recycling allocator, completion runs on the client strand
+    // (the concrete strand type spares copies of the type erased executor)
+    class http_process_handler {
+    public:
+        typedef http_recycling_allocator<void> allocator_type;
+        typedef asio_strand executor_type;
+
+        // the layer of the connection is held till the operation completes
+        http_process_handler(std::shared_ptr<http_process_target> t, const asio_strand& ex, unsigned int gen, http_stage s, std::shared_ptr<void> l = nullptr)
+            : target(std::move(t)), executor(ex), generation(gen), stage(s), layer(std::move(l))
+        {}
+
+        void operator()(http_error err, size_t transferred) {
+            auto t = std::move(target);
+            t->on_process(generation, stage, err, transferred);
         }
+
+        allocator_type get_allocator() const noexcept {
+            return allocator_type();
+        }
+
+        executor_type get_executor() const noexcept {
+            return executor;
+        }
+
+    private:
+        std::shared_ptr<http_process_target> target;
+        asio_strand executor;
+        unsigned int generation = 0;
+        http_stage stage = http_stage_none;
+        std::shared_ptr<void> layer;
     };
-    
+
     //---------------------------------------------------------------------------------------------
     // ugly request with different body types
 
     class http_request {
     public:
-        typedef std::function<void(http_error, size_t)> process_handler_type;
+        typedef http_process_handler process_handler_type;
         virtual ~http_request() {}
         virtual const http_string get(http_string key) = 0;
         virtual void set(http_string key, const http_string &value) = 0;
-        virtual void write(http_stream& stream, process_handler_type handler) = 0;
-        virtual void read(http_stream& stream, process_handler_type handler) = 0;
+        virtual http_verb method() = 0;
+        virtual bool keep_alive() = 0;
+        virtual void write(http_tcp_stream& stream, process_handler_type handler) = 0;
+        virtual void read(http_tcp_stream& stream, process_handler_type handler) = 0;
+#ifndef ASIO_POOL_HTTPS_IGNORE
+        virtual void write(http_ssl_stream& stream, process_handler_type handler) = 0;
+        virtual void read(http_ssl_stream& stream, process_handler_type handler) = 0;
+#endif
+        virtual void write(http2_stream& stream, process_handler_type handler) = 0;
+        virtual void read(http2_stream& stream, process_handler_type handler) = 0;
         virtual void end(http_error err, http_stage stage) = 0;
+
+        // response status code, 0 till the header is read
+        virtual unsigned status() { return 0; }
+
+        // body sizes of the last response decoded from its content coding
+        virtual http_decoded_size decoded_size() { return {}; }
+
+        // request target and header fields, e.g. for the response cache
+        virtual http_string target() { return http_string(); }
+        virtual const http_string request_field(http_string key) { return http_string(); }
+
+        // response body type kept by the response cache
+        virtual bool cacheable() { return false; }
+
+        // copy the response to the cache entry or take it from there, false if the body type is not kept
+        virtual bool save_response(http_cached_response& entry) { return false; }
+        virtual bool load_response(const http_cached_response& entry) { return false; }
+
+        // set by the response cache of the pool before the request is sent, called before the handler
+        std::shared_ptr<http_cache_link> cache_link;
+
+        // set by the connection, except the header time set by the request itself
+        http_request_timing timing;
+
+        // may be sent again after connection failure
+        virtual bool replayable() { return true; }
+
+        // the connection reading the response is dropped
+        virtual void on_dropped() {}
+
+        // set before enqueue
+        void set_priority(http_priority value) {
+            priority_class = value;
+        }
+
+        http_priority priority() const {
+            return priority_class;
+        }
+
+        // total deadline, time in the queue included, the request ends with beast::error::timeout after it
+        void expires_after(steady_clock::duration timeout) {
+            deadline = steady_clock::now() + timeout;
+        }
+
+        void expires_at(steady_clock::time_point time) {
+            deadline = time;
+        }
+
+        steady_clock::time_point expiry() const {
+            return deadline;
+        }
+
+        bool expired() const {
+            return deadline != steady_clock::time_point() && steady_clock::now() >= deadline;
+        }
+
+        // may be called from any thread: a queued request leaves the queue, a sent one drops its connection,
+        // the request ends with asio::error::operation_aborted
+        void cancel() {
+            std::shared_ptr<http_request_owner> target;
+            {
+                std::lock_guard<std::mutex> lock(owner_mutex);
+                if (cancelled) return;
+                cancelled = true;
+                target = owner.lock();
+            }
+            if (target) {
+                target->on_cancel(this);
+            }
+        }
+
+        bool is_cancelled() {
+            std::lock_guard<std::mutex> lock(owner_mutex);
+            return cancelled;
+        }
+
+        // connection or queue taking the request, false if it is already cancelled
+        bool attach(std::weak_ptr<http_request_owner> target) {
+            std::lock_guard<std::mutex> lock(owner_mutex);
+            owner = std::move(target);
+            return !cancelled;
+        }
+
+    private:
+        http_priority priority_class = http_priority_normal;
+        steady_clock::time_point deadline;
+        std::mutex owner_mutex;
+        std::weak_ptr<http_request_owner> owner;
+        bool cancelled = false;
     };
 
     typedef std::shared_ptr<http_request> http_request_ptr;
@@ -116,14 +693,352 @@ namespace tms {
     //typedef http::vector_body<uint8_t> http_binary_body;
     typedef http::dynamic_body http_binary_body;
 
-    typedef http::response<http_string_body> http_string_response;
-    typedef http::response<http_binary_body> http_binary_response;
+    typedef http::response<http_string_body, http_response_fields> http_string_response;
+    typedef http::response<http_binary_body, http_response_fields> http_binary_response;
+
+    // response body types kept by the response cache as bytes
+    template<typename body_type>
+    struct http_cache_body {
+        static bool supported() { return false; }
+        static void save(const typename body_type::value_type&, std::string&) {}
+        static void load(const std::string&, typename body_type::value_type&) {}
+    };
+
+    template<>
+    struct http_cache_body<http_string_body> {
+        static bool supported() { return true; }
+        static void save(const std::string& value, std::string& data) { data = value; }
+        static void load(const std::string& data, std::string& value) { value = data; }
+    };
+
+    template<>
+    struct http_cache_body<http_binary_body> {
+        static bool supported() { return true; }
+
+        static void save(const http_binary_body::value_type& value, std::string& data) {
+            data.resize(value.size());
+            asio::buffer_copy(asio::buffer(&data[0], data.size()), value.data());
+        }
+
+        static void load(const std::string& data, http_binary_body::value_type& value) {
+            value.consume(value.size());
+            value.commit(asio::buffer_copy(value.prepare(data.size()), asio::buffer(data)));
+        }
+    };
+
+    //---------------------------------------------------------------------------------------------
+    // response body decoded from gzip or deflate content coding while it is read, when the request asked for it;
+    // the decoded body goes to the reader of the given body type, Content-Encoding and Content-Length are removed
+
+    template<typename body_type>
+    struct http_decoded_body {
+        struct value_type {
+            typename body_type::value_type body;
+            bool decode = false;
+            uint64_t limit = 64 * 1024 * 1024;  // decoded bytes, guards against compression bombs
+            http_decoded_size size;
+        };
+
+        class reader {
+        public:
+            // made with the parser, the header is read later
+            template<bool is_request, typename fields_type>
+            reader(http::header<is_request, fields_type>& h, value_type& v)
+                : inner(h, v.body), value(v), header(&h), detect(&detect_format<http::header<is_request, fields_type> >)
+            {}
+
+            void init(const boost::optional<std::uint64_t>& length, http_error& ec) {
+                value.size = http_decoded_size();
+                if (value.decode) {
+                    format = detect(header);
+                }
+                inner.init(format == format_none ? length : boost::none, ec);
+            }
+
+            template<typename buffers_type>
+            size_t put(const buffers_type& buffers, http_error& ec) {
+                if (format == format_none) {
+                    return inner.put(buffers, ec);
+                }
+                size_t used = 0;
+                for (auto buffer : beast::buffers_range_ref(buffers)) {
+                    decode(static_cast<const uint8_t*>(buffer.data()), buffer.size(), ec);
+                    if (ec) break;
+                    used += buffer.size();
+                }
+                value.size.encoded += used;
+                return used;
+            }
+
+            // empty body (e.g. of HEAD) is fine, a cut one is not
+            void finish(http_error& ec) {
+                if (format != format_none && value.size.encoded > 0 && state != state_done) {
+                    ec = http::error::partial_message;
+                    return;
+                }
+                inner.finish(ec);
+            }
+
+        private:
+            enum coding_format {
+                format_none,
+                format_gzip,
+                format_zlib
+            };
+
+            // gzip member (RFC 1952) or zlib stream (RFC 1950) around the raw deflate data
+            enum decode_state {
+                state_header,
+                state_extra_size,
+                state_extra,
+                state_name,
+                state_comment,
+                state_header_crc,
+                state_data,
+                state_trailer,
+                state_done
+            };
+
+            typename body_type::reader inner;
+            value_type& value;
+            void* header;
+            coding_format (*detect)(void* header);
+            coding_format format = format_none;
+            decode_state state = state_header;
+            std::unique_ptr<beast::zlib::inflate_stream> inflater;
+            uint8_t fixed[10];
+            size_t fixed_size = 0;
+            size_t skip = 0;
+            uint8_t flags = 0;
+            bool raw = false;   // deflate data without zlib header and trailer
+            uint32_t crc = 0;
+            uint32_t decoded = 0;
+            uint32_t adler = 1;
+
+            enum gzip_flags {
+                gzip_header_crc = 2,
+                gzip_extra = 4,
+                gzip_name = 8,
+                gzip_comment = 16
+            };
+
+            // content coding of the header, removed with the length of coded body
+            template<typename header_type>
+            static coding_format detect_format(void* header) {
+                auto& h = *static_cast<header_type*>(header);
+                auto coding = h[http::field::content_encoding];
+                auto format = format_none;
+                if (beast::iequals(coding, "gzip") || beast::iequals(coding, "x-gzip")) {
+                    format = format_gzip;
+                }
+                else if (beast::iequals(coding, "deflate")) {
+                    format = format_zlib;
+                }
+                else {
+                    return format_none;
+                }
+                h.erase(http::field::content_encoding);
+                h.erase(http::field::content_length);
+                return format;
+            }
+
+            static uint32_t crc32(uint32_t crc, const uint8_t* data, size_t size) {
+                struct table_type {
+                    uint32_t values[256];
+                    table_type() {
+                        for (uint32_t i = 0; i < 256; i++) {
+                            auto c = i;
+                            for (int k = 0; k < 8; k++) {
+                                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                            }
+                            values[i] = c;
+                        }
+                    }
+                };
+                static const table_type table;
+                crc = ~crc;
+                for (size_t i = 0; i < size; i++) {
+                    crc = table.values[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+                }
+                return ~crc;
+            }
+
+            // sums modulo 65521, reduced each 5552 bytes before they can overflow
+            static uint32_t adler32(uint32_t adler, const uint8_t* data, size_t size) {
+                uint32_t a = adler & 0xffff, b = adler >> 16;
+                while (size > 0) {
+                    auto n = std::min<size_t>(size, 5552);
+                    size -= n;
+                    while (n-- > 0) {
+                        a += *data++;
+                        b += a;
+                    }
+                    a %= 65521;
+                    b %= 65521;
+                }
+                return (b << 16) | a;
+            }
+
+            // collect n bytes of the fixed part, false while more are needed
+            bool collect(const uint8_t*& p, const uint8_t* end, size_t n) {
+                while (fixed_size < n && p < end) {
+                    fixed[fixed_size++] = *p++;
+                }
+                if (fixed_size < n) return false;
+                fixed_size = 0;
+                return true;
+            }
+
+            void decode(const uint8_t* p, size_t size, http_error& ec) {
+                auto end = p + size;
+                while (p < end) {
+                    switch (state) {
+                    case state_header:
+                        if (format == format_gzip) {
+                            if (!collect(p, end, 10)) return;
+                            if (fixed[0] != 0x1f || fixed[1] != 0x8b || fixed[2] != 8) {
+                                ec = beast::zlib::error::general;
+                                return;
+                            }
+                            flags = fixed[3];
+                            crc = decoded = 0;
+                            state = state_extra_size;
+                        }
+                        else {
+                            if (!collect(p, end, 2)) return;
+                            // some servers send raw deflate data without the zlib header
+                            auto cmf = fixed[0], flg = fixed[1];
+                            state = state_data;
+                            if ((cmf & 0x0f) != 8 || ((cmf << 8) | flg) % 31 != 0 || (flg & 0x20)) {
+                                raw = true;
+                                inflate(fixed, 2, ec);
+                                if (ec) return;
+                            }
+                        }
+                        break;
+                    case state_extra_size:
+                        if (flags & gzip_extra) {
+                            if (!collect(p, end, 2)) return;
+                            skip = fixed[0] | (fixed[1] << 8);
+                            state = state_extra;
+                        }
+                        else {
+                            state = state_name;
+                        }
+                        break;
+                    case state_extra: {
+                        auto n = std::min<size_t>(skip, end - p);
+                        p += n;
+                        skip -= n;
+                        if (skip == 0) state = state_name;
+                        break;
+                    }
+                    case state_name:
+                    case state_comment: {
+                        auto flag = state == state_name ? gzip_name : gzip_comment;
+                        if (flags & flag) {
+                            while (p < end && *p != 0) p++;
+                            if (p == end) return;
+                            p++;
+                        }
+                        state = state == state_name ? state_comment : state_header_crc;
+                        break;
+                    }
+                    case state_header_crc:
+                        if ((flags & gzip_header_crc) && !collect(p, end, 2)) return;
+                        state = state_data;
+                        break;
+                    case state_data:
+                        p += inflate(p, end - p, ec);
+                        if (ec) return;
+                        break;
+                    case state_trailer: {
+                        if (!collect(p, end, format == format_gzip ? 8 : 4)) return;
+                        if (format == format_gzip) {
+                            auto expected = static_cast<uint32_t>(fixed[0] | (fixed[1] << 8) | (fixed[2] << 16)) | (static_cast<uint32_t>(fixed[3]) << 24);
+                            auto length = static_cast<uint32_t>(fixed[4] | (fixed[5] << 8) | (fixed[6] << 16)) | (static_cast<uint32_t>(fixed[7]) << 24);
+                            if (expected != crc || length != decoded) {
+                                ec = beast::zlib::error::general;
+                                return;
+                            }
+                        }
+                        else {
+                            auto expected = (static_cast<uint32_t>(fixed[0]) << 24) | (fixed[1] << 16) | (fixed[2] << 8) | fixed[3];
+                            if (expected != adler) {
+                                ec = beast::zlib::error::general;
+                                return;
+                            }
+                        }
+                        state = state_done;
+                        break;
+                    }
+                    case state_done:
+                        // gzip members may follow each other, anything after deflate data is ignored
+                        if (format == format_gzip && *p == 0x1f) {
+                            inflater->reset();
+                            state = state_header;
+                            break;
+                        }
+                        return;
+                    }
+                }
+            }
+
+            // raw deflate data till its end, the decoded bytes go to the inner reader
+            size_t inflate(const uint8_t* p, size_t size, http_error& ec) {
+                if (!inflater) {
+                    inflater.reset(new beast::zlib::inflate_stream());
+                }
+                uint8_t out[16384];
+                beast::zlib::z_params zs;
+                zs.next_in = p;
+                zs.avail_in = size;
+                for (;;) {
+                    zs.next_out = out;
+                    zs.avail_out = sizeof(out);
+                    inflater->write(zs, beast::zlib::Flush::none, ec);
+                    auto produced = sizeof(out) - zs.avail_out;
+                    if (produced > 0) {
+                        http_error put_error;
+                        value.size.decoded += produced;
+                        if (value.size.decoded > value.limit) {
+                            ec = http::error::body_limit;
+                            return 0;
+                        }
+                        if (format == format_gzip) {
+                            crc = crc32(crc, out, produced);
+                            decoded += static_cast<uint32_t>(produced);
+                        }
+                        else if (!raw) {
+                            adler = adler32(adler, out, produced);
+                        }
+                        inner.put(asio::const_buffer(out, produced), put_error);
+                        if (put_error) {
+                            ec = put_error;
+                            return 0;
+                        }
+                    }
+                    if (ec == beast::zlib::error::end_of_stream) {
+                        ec = {};
+                        state = raw ? state_done : state_trailer;
+                        break;
+                    }
+                    if (ec == beast::zlib::error::need_buffers) {
+                        ec = {};
+                        break;
+                    }
+                    if (ec || (zs.avail_in == 0 && zs.avail_out > 0)) break;
+                }
+                return size - zs.avail_in;
+            }
+        };
+    };
 
     template<typename request_body, typename response_body, typename handler_type>
     class http_request_t : public http_request {
     public:
-        typedef http::request<request_body> request_type;
-        typedef http::response<response_body> response_type;
+        typedef http::request<request_body, http_request_fields> request_type;
+        typedef http::response<response_body, http_response_fields> response_type;
         request_type request;
         response_type response;
 
@@ -132,8 +1047,10 @@ namespace tms {
         {}
 
         http_request_t(http_verb method, http_string target, std::string data, handler_type h)
-            : request(method, std::move(target), std::move(data), 11), handler(std::move(h))
-        {}
+            : request(method, std::move(target), 11, std::move(data)), handler(std::move(h))
+        {
+            request.prepare_payload();
+        }
 
         virtual const http_string get(http_string key) {
             return response[std::move(key)];
@@ -143,41 +1060,190 @@ namespace tms {
             request.set(std::move(key), value);
         }
 
-        // ugly write with ugly stream
-        virtual void write(http_stream& stream, process_handler_type handler) {
+        virtual http_verb method() {
+            return request.method();
+        }
 
-#ifndef ASIO_POOL_HTTPS_IGNORE
-            if (stream.ssl) {
-                http::async_write(*stream.ssl, request, handler);
-                return;
+        virtual bool keep_alive() {
+            return response.keep_alive();
+        }
+
+        virtual unsigned status() {
+            return response.result_int();
+        }
+
+        virtual http_decoded_size decoded_size() {
+            return decoded;
+        }
+
+        virtual http_string target() {
+            return request.target();
+        }
+
+        virtual const http_string request_field(http_string key) {
+            return request[std::move(key)];
+        }
+
+        virtual bool cacheable() {
+            return http_cache_body<response_body>::supported();
+        }
+
+        virtual bool save_response(http_cached_response& entry) {
+            if (!http_cache_body<response_body>::supported()) return false;
+            entry.header = response.base();
+            http_cache_body<response_body>::save(response.body(), entry.body);
+            return true;
+        }
+
+        virtual bool load_response(const http_cached_response& entry) {
+            if (!http_cache_body<response_body>::supported()) return false;
+            response = {};
+            response.base() = entry.header;
+            http_cache_body<response_body>::load(entry.body, response.body());
+            return true;
+        }
+
+        // ask for gzip or deflate content coding, the response body is decoded while it is read,
+        // a body decoded over the limit fails with http::error::body_limit
+        void decompress(bool value = true, uint64_t limit = 64 * 1024 * 1024) {
+            decoding = value;
+            decoding_limit = limit;
+            if (value) {
+                request.set(http::field::accept_encoding, "gzip, deflate");
             }
-#endif
-            if (stream.tcp) {
-                http::async_write(*stream.tcp, request, handler);
+            else {
+                request.erase(http::field::accept_encoding);
             }
         }
 
-        // ugly read with ugly stream
-        virtual void read(http_stream& stream, process_handler_type handler) {
+        virtual void write(http_tcp_stream& stream, process_handler_type handler) {
+            write_stream(stream, std::move(handler));
+        }
+
+        virtual void read(http_tcp_stream& stream, process_handler_type handler) {
+            read_stream(stream, std::move(handler));
+        }
 
 #ifndef ASIO_POOL_HTTPS_IGNORE
-            if (stream.ssl) {
-                http::async_read(*stream.ssl, buffer, response, handler);
-                return;
-            }
+        virtual void write(http_ssl_stream& stream, process_handler_type handler) {
+            write_stream(stream, std::move(handler));
+        }
+
+        virtual void read(http_ssl_stream& stream, process_handler_type handler) {
+            read_stream(stream, std::move(handler));
+        }
 #endif
-            if (stream.tcp) {
-                http::async_read(*stream.tcp, buffer, response, handler);
-            }
+
+        virtual void write(http2_stream& stream, process_handler_type handler) {
+            write_stream(stream, std::move(handler));
+        }
+
+        virtual void read(http2_stream& stream, process_handler_type handler) {
+            read_stream(stream, std::move(handler));
         }
 
         virtual void end(http_error err, http_stage stage) {
+            if (auto link = std::move(cache_link)) {
+                link->on_response(*this, err);
+            }
             std::move(handler)(err, stage, std::forward<response_type>(response));
         }
 
     protected:
-        beast::flat_buffer buffer;
+        typedef http::response_parser<http_decoded_body<response_body>, http_recycling_allocator<char> > parser_type;
         handler_type handler;
+        optional<parser_type> parser;
+        http_decoded_size decoded;
+        bool decoding = false;
+        uint64_t decoding_limit = 0;
+
+        // header and body are read apart to note the time of the header,
+        // allocator and executor of the process handler are passed to beast as is
+        template<typename stream_type>
+        class read_handler {
+        public:
+            typedef process_handler_type::allocator_type allocator_type;
+            typedef process_handler_type::executor_type executor_type;
+
+            read_handler(http_request_t* r, stream_type& s, process_handler_type h)
+                : owner(r), stream(&s), handler(std::move(h))
+            {}
+
+            void operator()(http_error err, size_t bytes) {
+                transferred += bytes;
+                if (header) {
+                    header = false;
+                    owner->timing.header = steady_clock::now();
+                    if (!err && !owner->parser->is_done()) {
+                        // the rest is often buffered with the header already, it is parsed in place
+                        // without one more operation
+                        auto& parser = *owner->parser;
+                        auto& buffer = stream->buffer;
+                        parser.eager(true);
+                        while (buffer.size() > 0 && !parser.is_done()) {
+                            auto used = parser.put(buffer.data(), err);
+                            if (err == http::error::need_more) {
+                                err = {};
+                                break;
+                            }
+                            if (err || used == 0) break;
+                            buffer.consume(used);
+                        }
+                    }
+                    if (!err && !owner->parser->is_done()) {
+                        auto started = stream->visit([this](auto& s) {
+                            http::async_read(s, stream->buffer, *owner->parser, std::move(*this));
+                        });
+                        if (started) return;
+
+                        // connection was dropped after the header
+                        err = asio::error::connection_aborted;
+                    }
+                }
+                if (owner->parser->is_header_done()) {
+                    auto message = owner->parser->release();
+                    owner->decoded = message.body().size;
+                    owner->response = response_type(std::move(message.base()), std::move(message.body().body));
+                }
+                handler(err, transferred);
+            }
+
+            allocator_type get_allocator() const noexcept {
+                return handler.get_allocator();
+            }
+
+            executor_type get_executor() const noexcept {
+                return handler.get_executor();
+            }
+
+        private:
+            http_request_t* owner;
+            stream_type* stream;
+            process_handler_type handler;
+            size_t transferred = 0;
+            bool header = true;
+        };
+
+        template<typename stream_type>
+        void write_stream(stream_type& stream, process_handler_type handler) {
+            stream.visit([this, &handler](auto& s) {
+                http::async_write(s, request, std::move(handler));
+            });
+        }
+
+        template<typename stream_type>
+        void read_stream(stream_type& stream, process_handler_type handler) {
+            // drop the rest of previous attempt
+            response = {};
+            decoded = {};
+            parser.emplace();
+            parser->get().body().decode = decoding;
+            parser->get().body().limit = decoding_limit;
+
+            stream.visit([this, &stream, &handler](auto& s) {
+                http::async_read_header(s, stream.buffer, *parser, read_handler<stream_type>(this, stream, std::move(handler)));
+            });
+        }
     };
 
     template<typename handler_type>
@@ -210,5 +1276,453 @@ namespace tms {
         }
     };
 
+    //---------------------------------------------------------------------------------------------
+    // upload file content, the file is read by parts while writing (beast has no sendfile path)
+
+    typedef http::file_body http_file_body;
+
+    template<typename response_body, typename handler_type>
+    class http_file_request_t : public http_request_t<http_file_body, response_body, handler_type> {
+    public:
+        typedef http_request_t<http_file_body, response_body, handler_type> base_type;
+        typedef typename base_type::process_handler_type process_handler_type;
+
+        http_file_request_t(http_verb method, http_string target, const char* path, handler_type h)
+            : base_type(method, std::move(target), std::move(h))
+        {
+            this->request.body().open(path, beast::file_mode::scan, open_error);
+            if (!open_error) {
+                this->request.prepare_payload();
+            }
+        }
+
+        virtual void write(http_tcp_stream& stream, process_handler_type handler) {
+            write_file(stream, std::move(handler));
+        }
+
+#ifndef ASIO_POOL_HTTPS_IGNORE
+        virtual void write(http_ssl_stream& stream, process_handler_type handler) {
+            write_file(stream, std::move(handler));
+        }
+#endif
+
+        virtual void write(http2_stream& stream, process_handler_type handler) {
+            write_file(stream, std::move(handler));
+        }
+
+    protected:
+        http_error open_error;
+
+        template<typename stream_type>
+        void write_file(stream_type& stream, process_handler_type handler) {
+            auto err = open_error;
+
+            // written again after connection failure
+            if (!err) {
+                this->request.body().file().seek(0, err);
+            }
+            if (err) {
+                auto ex = handler.get_executor();
+                asio::post(ex, beast::bind_front_handler(std::move(handler), err, 0));
+                return;
+            }
+            base_type::write_stream(stream, std::move(handler));
+        }
+    };
+
+    //---------------------------------------------------------------------------------------------
+    // upload generated content with chunked transfer encoding:
+    //   size_t producer(char* data, size_t size)
+    // fills at most size bytes of the data, returns 0 at the end of content
+
+    template<typename response_body, typename producer_type, typename handler_type>
+    class http_chunked_request_t : public http_request_t<http_empty_body, response_body, handler_type> {
+    public:
+        typedef http_request_t<http_empty_body, response_body, handler_type> base_type;
+        typedef typename base_type::process_handler_type process_handler_type;
+
+        http_chunked_request_t(http_verb method, http_string target, size_t window, producer_type p, handler_type h)
+            : base_type(method, std::move(target), std::move(h)), producer(std::move(p)), data(window > 0 ? window : 65536)
+        {
+            this->request.chunked(true);
+        }
+
+        // produced content can not be sent again
+        virtual bool replayable() {
+            return !produced;
+        }
+
+        virtual void write(http_tcp_stream& stream, process_handler_type handler) {
+            write_chunked(stream, std::move(handler));
+        }
+
+#ifndef ASIO_POOL_HTTPS_IGNORE
+        virtual void write(http_ssl_stream& stream, process_handler_type handler) {
+            write_chunked(stream, std::move(handler));
+        }
+#endif
+
+        virtual void write(http2_stream& stream, process_handler_type handler) {
+            write_chunked(stream, std::move(handler));
+        }
+
+    protected:
+        producer_type producer;
+        std::vector<char> data;
+        optional<http::request_serializer<http_empty_body, http_request_fields> > serializer;
+        optional<process_handler_type> complete;
+        size_t transferred = 0;
+        bool produced = false;
+        bool finished = false;
+
+        // completion of a part: holds the layer it was written on, which the connection may have dropped
+        // meanwhile, and passes the allocator and executor of the process handler to the operation
+        template<typename stream_type>
+        class write_handler {
+        public:
+            typedef typename process_handler_type::allocator_type allocator_type;
+            typedef typename process_handler_type::executor_type executor_type;
+            typedef decltype(std::declval<stream_type&>().current_layer()) layer_type;
+
+            write_handler(http_chunked_request_t* r, stream_type& s, layer_type l)
+                : owner(r), stream(&s), layer(std::move(l))
+            {}
+
+            void operator()(http_error err, size_t bytes) {
+                if (!err && stream->current_layer() != layer) {
+                    err = asio::error::connection_aborted;
+                }
+                owner->on_write(*stream, std::move(layer), err, bytes);
+            }
+
+            allocator_type get_allocator() const noexcept {
+                return owner->complete->get_allocator();
+            }
+
+            executor_type get_executor() const noexcept {
+                return owner->complete->get_executor();
+            }
+
+        private:
+            http_chunked_request_t* owner;
+            stream_type* stream;
+            layer_type layer;
+        };
+
+        template<typename stream_type>
+        void write_chunked(stream_type& stream, process_handler_type handler) {
+            complete.emplace(std::move(handler));
+            transferred = 0;
+            serializer.emplace(this->request);
+            auto layer = stream.current_layer();
+            if (!layer) {
+                auto h = std::move(*complete);
+                complete.reset();
+                auto ex = h.get_executor();
+                return asio::post(ex, beast::bind_front_handler(std::move(h), http_error(asio::error::connection_aborted), 0));
+            }
+            auto& s = *layer;
+            http::async_write_header(s, *serializer, write_handler<stream_type>(this, stream, std::move(layer)));
+        }
+
+        template<typename stream_type, typename layer_type>
+        void on_write(stream_type& stream, layer_type layer, http_error err, size_t bytes) {
+            transferred += bytes;
+            if (err || finished) {
+                return finish(err);
+            }
+            produced = true;
+            auto size = producer(data.data(), data.size());
+            stream.extend();
+            auto& s = *layer;
+            write_handler<stream_type> h(this, stream, std::move(layer));
+            if (size > 0) {
+                asio::async_write(s, http::make_chunk(asio::buffer(data.data(), size)), std::move(h));
+            }
+            else {
+                finished = true;
+                asio::async_write(s, http::make_chunk_last(), std::move(h));
+            }
+        }
+
+        void finish(http_error err) {
+            auto h = std::move(*complete);
+            complete.reset();
+            h(err, transferred);
+        }
+    };
+
+    //---------------------------------------------------------------------------------------------
+    // streaming response, body is passed to chunk handler by parts of at most window size:
+    //   bool chunk_handler(const http_response_header& header, http_string data)
+    // the first call with empty data follows the header, returning false pauses reading till resume(),
+    // finally handler(http_error err, http_stage stage, http_response_header&& header) is called
+
+    typedef http::response_header<> http_response_header;
+
+    template<typename request_body, typename chunk_handler_type, typename handler_type>
+    class http_stream_request_t :
+        public http_request,
+        public std::enable_shared_from_this<http_stream_request_t<request_body, chunk_handler_type, handler_type> >
+    {
+    public:
+        typedef http::request<request_body, http_request_fields> request_type;
+        typedef http::response_parser<http::buffer_body> parser_type;
+        request_type request;
+
+        http_stream_request_t(http_verb method, http_string target, size_t window, chunk_handler_type c, handler_type h)
+            : request(method, std::move(target), 11), chunk(std::move(c)), handler(std::move(h)), data(window > 0 ? window : 65536)
+        {}
+
+        http_stream_request_t(http_verb method, http_string target, std::string body, size_t window, chunk_handler_type c, handler_type h)
+            : request(method, std::move(target), 11, std::move(body)), chunk(std::move(c)), handler(std::move(h)), data(window > 0 ? window : 65536)
+        {
+            request.prepare_payload();
+        }
+
+        virtual const http_string get(http_string key) {
+            if (!parser) return http_string();
+            return parser->get()[std::move(key)];
+        }
+
+        virtual void set(http_string key, const http_string& value) {
+            request.set(std::move(key), value);
+        }
+
+        virtual http_verb method() {
+            return request.method();
+        }
+
+        virtual bool keep_alive() {
+            return parser && parser->keep_alive();
+        }
+
+        virtual unsigned status() {
+            return parser && parser->is_header_done() ? parser->get().result_int() : 0;
+        }
+
+        virtual http_string target() {
+            return request.target();
+        }
+
+        virtual bool replayable() {
+            return !delivered;
+        }
+
+        virtual void write(http_tcp_stream& stream, process_handler_type handler) {
+            write_stream(stream, std::move(handler));
+        }
+
+        virtual void read(http_tcp_stream& stream, process_handler_type handler) {
+            read_stream(stream, std::move(handler));
+        }
+
+#ifndef ASIO_POOL_HTTPS_IGNORE
+        virtual void write(http_ssl_stream& stream, process_handler_type handler) {
+            write_stream(stream, std::move(handler));
+        }
+
+        virtual void read(http_ssl_stream& stream, process_handler_type handler) {
+            read_stream(stream, std::move(handler));
+        }
+#endif
+
+        virtual void write(http2_stream& stream, process_handler_type handler) {
+            write_stream(stream, std::move(handler));
+        }
+
+        virtual void read(http2_stream& stream, process_handler_type handler) {
+            read_stream(stream, std::move(handler));
+        }
+
+        virtual void end(http_error err, http_stage stage) {
+            if (auto link = std::move(cache_link)) {
+                link->on_response(*this, err);
+            }
+            http_response_header header;
+            if (parser) {
+                header = std::move(parser->get().base());
+            }
+            std::move(handler)(err, stage, std::move(header));
+        }
+
+        // continue paused reading, may be called from any thread, also by the chunk handler itself
+        void resume() {
+            int expected = state_pausing;
+            if (state.compare_exchange_strong(expected, state_running)) {
+                return;
+            }
+            expected = state_paused;
+            if (state.compare_exchange_strong(expected, state_running)) {
+                auto self = this->shared_from_this();
+                asio::post(executor, [self]() {
+                    // a copy, finish() clears it
+                    if (auto part = self->next_part) {
+                        part();
+                    }
+                });
+            }
+        }
+
+        // paused reading has no operation to fail with the dropped connection, it goes on and fails
+        virtual void on_dropped() {
+            resume();
+        }
+
+    protected:
+        chunk_handler_type chunk;
+        handler_type handler;
+        std::vector<char> data;
+        optional<parser_type> parser;
+        asio_io_executor executor;
+        std::function<void()> next_part;
+        optional<process_handler_type> complete;
+        size_t transferred = 0;
+        bool delivered = false;
+
+        // set before the chunk handler is called, so resume() from another thread is not lost
+        enum read_state {
+            state_running,
+            state_pausing,
+            state_paused,
+            state_done
+        };
+        std::atomic<int> state{ state_done };
+
+        template<typename stream_type>
+        void write_stream(stream_type& stream, process_handler_type handler) {
+            stream.visit([this, &handler](auto& s) {
+                http::async_write(s, request, std::move(handler));
+            });
+        }
+
+        template<typename stream_type>
+        void read_stream(stream_type& stream, process_handler_type handler) {
+            parser.emplace();
+            parser->body_limit(std::numeric_limits<std::uint64_t>::max());
+            stream.buffer.reserve(data.size());
+            executor = stream.get()->get_executor();
+            auto self = this->shared_from_this();
+            next_part = [self, &stream]() {
+                self->read_next(stream);
+            };
+            complete.emplace(std::move(handler));
+            transferred = 0;
+            state = state_running;
+            stream.visit([this, &stream](auto& s) {
+                http::async_read_header(s, stream.buffer, *parser, [this, &stream](http_error err, size_t bytes) {
+                    on_header(stream, err, bytes);
+                });
+            });
+        }
+
+        template<typename stream_type>
+        void on_header(stream_type& stream, http_error err, size_t bytes) {
+            transferred += bytes;
+            timing.header = steady_clock::now();
+            if (err) {
+                return finish(err);
+            }
+            delivered = true;
+            deliver(stream, http_string());
+        }
+
+        // the chunk handler returning false pauses reading, unless resume() is called meanwhile
+        template<typename stream_type>
+        void deliver(stream_type& stream, http_string part) {
+            state = state_pausing;
+            if (!chunk(parser->get().base(), std::move(part))) {
+                int expected = state_pausing;
+                if (state.compare_exchange_strong(expected, state_paused)) {
+                    return;
+                }
+            }
+            state = state_running;
+            read_next(stream);
+        }
+
+        template<typename stream_type>
+        void read_next(stream_type& stream) {
+            if (parser->is_done()) {
+                return finish({});
+            }
+            auto& body = parser->get().body();
+            body.data = data.data();
+            body.size = data.size();
+            stream.extend();
+            auto started = stream.visit([this, &stream](auto& s) {
+                http::async_read_some(s, stream.buffer, *parser, [this, &stream](http_error err, size_t bytes) {
+                    on_chunk(stream, err, bytes);
+                });
+            });
+
+            // connection was dropped while paused
+            if (!started) {
+                finish(asio::error::connection_aborted);
+            }
+        }
+
+        template<typename stream_type>
+        void on_chunk(stream_type& stream, http_error err, size_t bytes) {
+            transferred += bytes;
+            if (err == http::error::need_buffer) {
+                err = {};
+            }
+            if (err) {
+                return finish(err);
+            }
+            auto size = data.size() - parser->get().body().size;
+            if (size > 0) {
+                return deliver(stream, http_string(data.data(), size));
+            }
+            read_next(stream);
+        }
+
+        // next_part holds the request, a late resume() finds nothing to continue
+        void finish(http_error err) {
+            state = state_done;
+            next_part = nullptr;
+            auto h = std::move(*complete);
+            complete.reset();
+            h(err, transferred);
+        }
+    };
+
+    template<typename chunk_handler_type, typename handler_type>
+    class http_stream_get : public http_stream_request_t<http_empty_body, chunk_handler_type, handler_type> {
+    public:
+        http_stream_get(http_string target, size_t window, chunk_handler_type c, handler_type h)
+            : http_stream_request_t<http_empty_body, chunk_handler_type, handler_type>(http_verb::get, std::move(target), window, std::move(c), std::move(h))
+        {
+        }
+    };
+
+    //---------------------------------------------------------------------------------------------
+    // completion handler made from asio completion token (callback, use_future, use_awaitable),
+    // lives inside the request, keeps its executor busy and completes there:
+    //   void(http_error err, http_stage stage, response_type response)
+
+    template<typename completion_type, typename response_type>
+    class http_async_handler {
+    public:
+        typedef asio::associated_executor_t<completion_type, asio_executor> executor_type;
+
+        http_async_handler(completion_type h, const asio_executor& ex)
+            : handler(std::move(h)),
+              work(asio::prefer(asio::get_associated_executor(handler, ex), asio::execution::outstanding_work.tracked))
+        {}
+
+        void operator()(http_error err, http_stage stage, response_type&& response) {
+            auto ex = std::move(work);
+            asio::dispatch(ex, beast::bind_front_handler(std::move(handler), err, stage, std::move(response)));
+        }
+
+    private:
+        typedef typename std::decay<decltype(asio::prefer(std::declval<executor_type>(), asio::execution::outstanding_work.tracked))>::type work_type;
+
+        completion_type handler;
+        work_type work;
+    };
+
     //---------------------------------------------------------------------------------------------
 }
@@ -223,5 +223,111 @@ namespace tms {
     typedef uri_t<wchar_t, wstring_view> uri_wview;
     typedef uri_t<wchar_t, std::wstring> uri_wstr;
 
+    //---------------------------------------------------------------------------------------------
+    // latency histogram of microseconds, HDR-like: exact below 32us, then 16 buckets per power of two
+    // (under 1/16 relative error) up to 2^37us, recording is a relaxed atomic increment
+
+    class latency_snapshot {
+    public:
+        void add(size_t index, uint64_t count) {
+            if (count == 0) return;
+            auto ptr = std::lower_bound(buckets.begin(), buckets.end(), std::make_pair(static_cast<uint32_t>(index), uint64_t(0)));
+            if (ptr != buckets.end() && ptr->first == index) ptr->second += count;
+            else buckets.insert(ptr, std::make_pair(static_cast<uint32_t>(index), count));
+            total += count;
+        }
+
+        void add_sum(uint64_t us) {
+            micros += us;
+        }
+
+        void merge(const latency_snapshot& other) {
+            for (auto& bucket : other.buckets) {
+                add(bucket.first, bucket.second);
+            }
+            micros += other.micros;
+        }
+
+        uint64_t count() const {
+            return total;
+        }
+
+        // seconds of all recorded times
+        double sum() const {
+            return micros * 1e-6;
+        }
+
+        // seconds, e.g. percentile(0.99), 0 if empty
+        double percentile(double q) const {
+            if (total == 0) return 0;
+            auto rank = static_cast<uint64_t>(std::ceil(q * total));
+            if (rank == 0) rank = 1;
+            uint64_t sum = 0;
+            for (auto& bucket : buckets) {
+                sum += bucket.second;
+                if (sum >= rank) return value(bucket.first);
+            }
+            return value(buckets.back().first);
+        }
+
+        double max() const {
+            return buckets.empty() ? 0 : value(buckets.back().first);
+        }
+
+        // middle of the bucket in seconds
+        static double value(size_t index) {
+            if (index < 32) return index * 1e-6;
+            auto shift = index / 16 - 1;
+            auto lower = static_cast<uint64_t>(index % 16 + 16) << shift;
+            return (lower + (uint64_t(1) << shift) / 2.) * 1e-6;
+        }
+
+    private:
+        // non empty buckets ordered by index
+        std::vector<std::pair<uint32_t, uint64_t> > buckets;
+        uint64_t total = 0;
+        uint64_t micros = 0;
+    };
+
+    class latency_histogram {
+    public:
+        static const size_t bucket_count = 16 * 34;
+
+        latency_histogram() {
+            for (auto& count : counts) {
+                count.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        void record(steady_clock::duration d) {
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+            auto value = us > 0 ? static_cast<uint64_t>(us) : 0;
+            counts[index(value)].fetch_add(1, std::memory_order_relaxed);
+            sum.fetch_add(value, std::memory_order_relaxed);
+        }
+
+        void snapshot(latency_snapshot& result, bool reset) {
+            for (size_t i = 0; i < bucket_count; i++) {
+                result.add(i, reset ? counts[i].exchange(0, std::memory_order_relaxed) : counts[i].load(std::memory_order_relaxed));
+            }
+            result.add_sum(reset ? sum.exchange(0, std::memory_order_relaxed) : sum.load(std::memory_order_relaxed));
+        }
+
+        static size_t index(uint64_t us) {
+            if (us < 32) return static_cast<size_t>(us);
+            unsigned msb = 0;
+            for (unsigned step = 32; step > 0; step >>= 1) {
+                if (us >> (msb + step)) msb += step;
+            }
+            auto shift = msb - 4;
+            auto result = (shift + 1) * 16 + static_cast<size_t>((us >> shift) - 16);
+            return result < bucket_count ? result : bucket_count - 1;
+        }
+
+    private:
+        std::atomic<uint32_t> counts[bucket_count];
+        std::atomic<uint64_t> sum{ 0 };
+    };
+
     //---------------------------------------------------------------------------------------------
 }
\ No newline at end of file
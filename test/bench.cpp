@@ -0,0 +1,111 @@
+#ifdef _MSC_VER
+#pragma warning(disable:4503)
+#endif
+
+// replaced global new/delete are seen as mismatched with inlined std::allocator
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+#include <iostream>
+#include <cstdlib>
+#include <new>
+
+#ifndef ASIO_POOL_HTTPS_IGNORE
+#define ASIO_POOL_HTTPS_IGNORE
+#endif
+
+// the client runs on io_context threads, sockets, timers and handlers take its strands as they are
+#define ASIO_POOL_EXECUTOR boost::asio::io_context::executor_type
+
+#include "../src/http_pool.h"
+#include "local_server.h"
+
+using namespace tms;
+
+//-------------------------------------------------------------------------------------------------
+// count heap allocations of the client, the server thread is not counted
+
+static std::atomic<size_t> allocations(0);
+static thread_local bool server_thread = false;
+
+void* operator new(std::size_t size) {
+    if (!server_thread) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (void* ptr = std::malloc(size ? size : 1)) return ptr;
+    throw std::bad_alloc();
+}
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+//-------------------------------------------------------------------------------------------------
+// keep "inflight" requests running in a closed loop
+
+static const int thread_count = 2;
+static const int inflight = 16;
+static const size_t warmup_requests = 20000;
+static const size_t measure_requests = 100000;
+
+static asio::io_context server;
+static asio::io_context io;
+static http_client_pool pool(io.get_executor(), 1);
+static std::string port;
+static std::atomic<size_t> completed(0);
+static std::atomic<size_t> failed(0);
+
+static void bench_request() {
+    pool.enqueue<http_string_body>("127.0.0.1", port, "/bench", nullopt, [](http_error err, http_stage stage, http_string_response&& resp) {
+        if (err) failed++;
+        completed++;
+        bench_request();
+    });
+}
+
+static void bench_wait(size_t count) {
+    while (completed < count) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+int main() {
+    // the same small keep-alive response to every request
+    local_server responder(server.get_executor(), [](const local_request&) {
+        return local_reply(local_server::response(200, "Connection: keep-alive\r\n", "hello, world"));
+    });
+    port = responder.port();
+    std::thread server_runner([]() {
+        server_thread = true;
+        server.run();
+    });
+    server_runner.detach();
+
+    auto work = asio::make_work_guard(io);
+    for (int i = 0; i < thread_count; i++) {
+        std::thread([]() { io.run(); }).detach();
+    }
+
+    for (int i = 0; i < inflight; i++) {
+        bench_request();
+    }
+    bench_wait(warmup_requests);
+
+    auto count = completed.load();
+    auto allocs = allocations.load();
+    auto time = steady_clock::now();
+    bench_wait(count + measure_requests);
+    auto seconds = std::chrono::duration<double>(steady_clock::now() - time).count();
+    allocs = allocations.load() - allocs;
+    count = completed.load() - count;
+
+    std::cout << "requests: " << count
+        << "; errors: " << failed
+        << "; " << (int)(count / seconds) << " req/s"
+        << "; allocations: " << (double)allocs / count << " per request" << std::endl;
+
+    std::_Exit(failed ? 1 : 0);
+}
@@ -0,0 +1,359 @@
+#ifdef _MSC_VER
+#pragma warning(disable:4503)
+#endif
+
+#include <iostream>
+#include <future>
+
+#ifndef ASIO_POOL_HTTPS_IGNORE
+#define ASIO_POOL_HTTPS_IGNORE
+#endif
+
+#include "../src/http_pool.h"
+
+using namespace tms;
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& name) {
+    std::cout << (ok ? "ok     " : "FAILED ") << name << std::endl;
+    if (!ok) failures++;
+}
+
+static std::string hex(const char* text) {
+    std::string out;
+    for (auto p = text; p[0] && p[1];) {
+        if (*p == ' ') {
+            p++;
+            continue;
+        }
+        out.push_back(static_cast<char>(std::stoi(std::string(p, 2), nullptr, 16)));
+        p += 2;
+    }
+    return out;
+}
+
+static bool decode(http2_hpack_decoder& decoder, const char* block, const http2_fields& expected) {
+    auto data = hex(block);
+    http2_fields fields;
+    return decoder.decode(reinterpret_cast<const uint8_t*>(data.data()), data.size(), fields) && fields == expected;
+}
+
+//-------------------------------------------------------------------------------------------------
+// RFC 7541 Appendix C
+
+static void test_integers() {
+    std::string out;
+    http2_hpack::encode_integer(out, 0, 5, 10);
+    check(out == hex("0a"), "C.1.1 10 with 5-bit prefix");
+    out.clear();
+    http2_hpack::encode_integer(out, 0, 5, 1337);
+    check(out == hex("1f9a0a"), "C.1.2 1337 with 5-bit prefix");
+    out.clear();
+    http2_hpack::encode_integer(out, 0, 8, 42);
+    check(out == hex("2a"), "C.1.3 42 starting at an octet boundary");
+
+    auto data = hex("1f9a0a");
+    auto p = reinterpret_cast<const uint8_t*>(data.data());
+    size_t value = 0;
+    check(http2_hpack::decode_integer(p, p + data.size(), 5, value) && value == 1337, "C.1.2 decoded");
+    p = reinterpret_cast<const uint8_t*>(data.data());
+    check(!http2_hpack::decode_integer(p, p + 2, 5, value), "truncated integer");
+}
+
+static void test_fields() {
+    http2_hpack_decoder decoder;
+    check(decode(decoder, "400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164 6572",
+        { { "custom-key", "custom-header" } }), "C.2.1 literal with indexing");
+    check(decode(decoder, "040c 2f73 616d 706c 652f 7061 7468", { { ":path", "/sample/path" } }), "C.2.2 literal without indexing");
+    check(decode(decoder, "1008 7061 7373 776f 7264 0673 6563 7265 74", { { "password", "secret" } }), "C.2.3 literal never indexed");
+    check(decode(decoder, "82", { { ":method", "GET" } }), "C.2.4 indexed");
+    check(decode(decoder, "be", { { "custom-key", "custom-header" } }), "C.2.1 entry in the dynamic table");
+
+    // no dynamic table on our side, so the encoder writes the static index or a literal without indexing
+    std::string out;
+    http2_hpack::encode_field(out, ":method", "GET");
+    http2_hpack::encode_field(out, ":path", "/sample/path");
+    check(out == hex("82 040c 2f73 616d 706c 652f 7061 7468"), "encoded fields");
+}
+
+static void test_requests(bool huffman) {
+    http2_hpack_decoder decoder;
+    std::string name = huffman ? "C.4" : "C.3";
+    check(decode(decoder, huffman ? "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff" : "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", {
+        { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, { ":authority", "www.example.com" }
+    }), name + ".1 first request");
+    check(decode(decoder, huffman ? "8286 84be 5886 a8eb 1064 9cbf" : "8286 84be 5808 6e6f 2d63 6163 6865", {
+        { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, { ":authority", "www.example.com" }, { "cache-control", "no-cache" }
+    }), name + ".2 second request");
+    check(decode(decoder, huffman ? "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf" : "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65", {
+        { ":method", "GET" }, { ":scheme", "https" }, { ":path", "/index.html" }, { ":authority", "www.example.com" }, { "custom-key", "custom-value" }
+    }), name + ".3 third request");
+}
+
+// the examples evict with a 256 bytes table, the decoder keeps 4096 bytes: newer entries have the same indexes
+static void test_responses(bool huffman) {
+    http2_hpack_decoder decoder;
+    std::string name = huffman ? "C.6" : "C.5";
+    check(decode(decoder, huffman ?
+        "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad 1718 63c7 8f0b 97c8 e9ae 82ae 43d3" :
+        "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3120 474d 546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", {
+        { ":status", "302" }, { "cache-control", "private" }, { "date", "Mon, 21 Oct 2013 20:13:21 GMT" }, { "location", "https://www.example.com" }
+    }), name + ".1 first response");
+    check(decode(decoder, huffman ? "4883 640e ffc1 c0bf" : "4803 3330 37c1 c0bf", {
+        { ":status", "307" }, { "cache-control", "private" }, { "date", "Mon, 21 Oct 2013 20:13:21 GMT" }, { "location", "https://www.example.com" }
+    }), name + ".2 second response");
+    check(decode(decoder, huffman ?
+        "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab 77ad 94e7 821d d7f2 e6c7 b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed 4ee5 b106 3d50 07" :
+        "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d 54c0 5a04 677a 6970 7738 666f 6f3d 4153 444a 4b48 514b 425a 584f 5157 454f 5049 5541 5851 5745 4f49 553b 206d 6178 2d61 6765 3d33 3630 303b 2076 6572 7369 6f6e 3d31", {
+        { ":status", "200" }, { "cache-control", "private" }, { "date", "Mon, 21 Oct 2013 20:13:22 GMT" }, { "location", "https://www.example.com" },
+        { "content-encoding", "gzip" }, { "set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1" }
+    }), name + ".3 third response");
+}
+
+static void test_errors() {
+    http2_hpack_decoder decoder;
+    http2_fields fields;
+    auto data = hex("be");
+    check(!decoder.decode(reinterpret_cast<const uint8_t*>(data.data()), data.size(), fields), "index out of the tables");
+    data = hex("0081 ff");
+    check(!decoder.decode(reinterpret_cast<const uint8_t*>(data.data()), data.size(), fields), "huffman padding longer than 7 bits");
+    data = hex("3fe2 1f");
+    check(!decoder.decode(reinterpret_cast<const uint8_t*>(data.data()), data.size(), fields), "table size over the limit");
+}
+
+//-------------------------------------------------------------------------------------------------
+// frame parser of the session: a local h2c server answers by the request path with crafted frames
+
+static std::atomic<bool> ping_acked(false);
+static std::atomic<bool> goaway_sent(false);
+static std::atomic<int> goaway_received(-1);
+static std::atomic<int> reset_received(-1);
+
+class frame_session : public std::enable_shared_from_this<frame_session> {
+public:
+    explicit frame_session(tcp::socket s) : socket(std::move(s)) {}
+
+    void start() {
+        std::string out;
+        http2_frame::header(out, 0, http2_frame::settings, 0, 0);
+        send(std::move(out));
+        read();
+    }
+
+private:
+    tcp::socket socket;
+    char data[4096];
+    std::string input, pending, sending;
+    bool preface = false;
+    http2_hpack_decoder decoder;
+
+    void read() {
+        auto self = shared_from_this();
+        socket.async_read_some(asio::buffer(data), [self](http_error err, size_t size) {
+            if (err) return;
+            self->input.append(self->data, size);
+            self->parse();
+            self->read();
+        });
+    }
+
+    // a single write at a time, the rest waits
+    void send(std::string out) {
+        pending += out;
+        if (!sending.empty()) return;
+        sending.swap(pending);
+        auto self = shared_from_this();
+        asio::async_write(socket, asio::buffer(sending), [self](http_error err, size_t) {
+            self->sending.clear();
+            if (!err && !self->pending.empty()) self->send(std::string());
+        });
+    }
+
+    void parse() {
+        if (!preface) {
+            if (input.size() < 24) return;
+            input.erase(0, 24);
+            preface = true;
+        }
+        while (input.size() >= http2_frame::header_size) {
+            auto p = reinterpret_cast<const uint8_t*>(input.data());
+            size_t length = (static_cast<size_t>(p[0]) << 16) | (static_cast<size_t>(p[1]) << 8) | p[2];
+            if (input.size() < http2_frame::header_size + length) return;
+            auto type = p[3], flags = p[4];
+            auto id = http2_frame::read32(p + 5) & 0x7fffffff;
+            std::string out;
+            if (type == http2_frame::settings && !(flags & http2_frame::ack)) {
+                http2_frame::header(out, 0, http2_frame::settings, http2_frame::ack, 0);
+            }
+            else if (type == http2_frame::ping && (flags & http2_frame::ack)) {
+                ping_acked = true;
+            }
+            else if (type == http2_frame::goaway && length >= 8) {
+                goaway_received = static_cast<int>(http2_frame::read32(p + http2_frame::header_size + 4));
+            }
+            else if (type == http2_frame::rst_stream && length == 4) {
+                reset_received = static_cast<int>(http2_frame::read32(p + http2_frame::header_size));
+            }
+            else if (type == http2_frame::headers) {
+                http2_fields fields;
+                decoder.decode(p + http2_frame::header_size, length, fields);
+                for (auto& field : fields) {
+                    if (field.first == ":path") answer(out, field.second, id);
+                }
+            }
+            input.erase(0, http2_frame::header_size + length);
+            if (!out.empty()) send(std::move(out));
+        }
+    }
+
+    void answer(std::string& out, const std::string& path, uint32_t id) {
+        std::string block;
+        http2_hpack::encode_field(block, ":status", "200");
+        http2_hpack::encode_field(block, "content-length", "5");
+        if (path == "/split" || (path == "/goaway" && goaway_sent)) {
+            // a PING first, then padded HEADERS with priority, CONTINUATION and padded DATA
+            http2_frame::header(out, 8, http2_frame::ping, 0, 0);
+            out.append("pingpong");
+            http2_frame::header(out, 1 + 5 + 1 + 2, http2_frame::headers, http2_frame::padded | http2_frame::priority_flag, id);
+            out.push_back(2);
+            out.append(std::string("\0\0\0\0\x10", 5));
+            out.append(block, 0, 1);
+            out.append(2, '\0');
+            http2_frame::header(out, block.size() - 1, http2_frame::continuation, http2_frame::end_headers, id);
+            out.append(block, 1, std::string::npos);
+            http2_frame::header(out, 1 + 5 + 3, http2_frame::data, http2_frame::padded | http2_frame::end_stream, id);
+            out.push_back(3);
+            out.append("hello");
+            out.append(3, '\0');
+        }
+        else if (path == "/goaway") {
+            // the stream is not processed, the request goes again on a new connection
+            goaway_sent = true;
+            http2_frame::header(out, 8, http2_frame::goaway, 0, 0);
+            http2_frame::append32(out, 0);
+            http2_frame::append32(out, 0);
+        }
+        else if (path == "/reset") {
+            http2_frame::header(out, 4, http2_frame::rst_stream, 0, id);
+            http2_frame::append32(out, static_cast<uint32_t>(http2_errc::internal_error));
+        }
+        else if (path == "/oversized") {
+            http2_frame::header(out, http2_frame::default_frame_size + 1, http2_frame::data, 0, id);
+        }
+        else if (path == "/flood") {
+            // CONTINUATION frames past the header list size, none of them ends the block
+            http2_frame::header(out, block.size(), http2_frame::headers, 0, id);
+            out.append(block);
+            for (int i = 0; i < 5; i++) {
+                http2_frame::header(out, http2_frame::default_frame_size, http2_frame::continuation, 0, id);
+                out.append(http2_frame::default_frame_size, '\0');
+            }
+        }
+        else if (path == "/zero-increment") {
+            http2_frame::header(out, 4, http2_frame::window_update, 0, id);
+            http2_frame::append32(out, 0);
+        }
+        else if (path == "/window-overflow") {
+            http2_frame::header(out, 4, http2_frame::window_update, 0, 0);
+            http2_frame::append32(out, 0x7fffffff);
+        }
+        else if (path == "/padding") {
+            // pad length not less than the payload
+            http2_frame::header(out, block.size(), http2_frame::headers, http2_frame::end_headers, id);
+            out.append(block);
+            http2_frame::header(out, 2, http2_frame::data, http2_frame::padded | http2_frame::end_stream, id);
+            out.push_back(2);
+            out.push_back('x');
+        }
+    }
+};
+
+static void frame_accept(tcp::acceptor& acceptor) {
+    acceptor.async_accept([&acceptor](http_error err, tcp::socket socket) {
+        if (!err) std::make_shared<frame_session>(std::move(socket))->start();
+        frame_accept(acceptor);
+    });
+}
+
+// the server runs on its own thread, its sessions need no strand
+static asio::thread_pool io(2);
+static asio::thread_pool server(1);
+
+static std::pair<http_error, http_string_response> get(http_client_pool& pool, const std::string& port, const std::string& path) {
+    auto promise = std::make_shared<std::promise<std::pair<http_error, http_string_response> > >();
+    auto future = promise->get_future();
+    pool.enqueue<http_string_body>("127.0.0.1", port, path, nullopt, [promise](http_error err, http_stage stage, http_string_response&& resp) {
+        promise->set_value(std::make_pair(err, std::move(resp)));
+    });
+    return future.get();
+}
+
+// the code the server got in GOAWAY or RST_STREAM, -1 if none in time
+static int received(std::atomic<int>& code) {
+    for (int i = 0; i < 100 && code < 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return code.exchange(-1);
+}
+
+static void test_frames() {
+    tcp::acceptor acceptor(server, tcp_endpoint(asio::ip::make_address("127.0.0.1"), 0));
+    auto port = std::to_string(acceptor.local_endpoint().port());
+    frame_accept(acceptor);
+
+    http_client_pool pool(io.get_executor(), 1);
+    pool.set_http2(http2_prior_knowledge);
+
+    auto result = get(pool, port, "/split");
+    check(!result.first && result.second.result_int() == 200 && result.second.body() == "hello", "padded HEADERS with priority, CONTINUATION, padded DATA");
+    for (int i = 0; i < 100 && !ping_acked; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    check(ping_acked, "PING acknowledged");
+
+    result = get(pool, port, "/reset");
+    check(result.first == make_error_code(http2_errc::internal_error), "RST_STREAM fails the request with its code");
+
+    result = get(pool, port, "/goaway");
+    check(!result.first && result.second.body() == "hello", "stream refused by GOAWAY goes on a new connection");
+
+    result = get(pool, port, "/padding");
+    check(result.first == make_error_code(http2_errc::protocol_error), "pad length over the payload is a protocol error");
+    check(received(goaway_received) == static_cast<int>(http2_errc::protocol_error), "GOAWAY with the protocol error");
+
+    result = get(pool, port, "/flood");
+    check(result.first == make_error_code(http2_errc::enhance_your_calm), "header block over the header list size");
+    check(received(goaway_received) == static_cast<int>(http2_errc::enhance_your_calm), "GOAWAY with enhance your calm");
+
+    result = get(pool, port, "/zero-increment");
+    check(result.first == make_error_code(http2_errc::protocol_error), "zero WINDOW_UPDATE increment of a stream");
+    check(received(reset_received) == static_cast<int>(http2_errc::protocol_error), "RST_STREAM with the protocol error");
+
+    result = get(pool, port, "/window-overflow");
+    check(result.first == make_error_code(http2_errc::flow_control_error), "connection window past 2^31-1");
+    check(received(goaway_received) == static_cast<int>(http2_errc::flow_control_error), "GOAWAY with the flow control error");
+
+    result = get(pool, port, "/oversized");
+    check(result.first == make_error_code(http2_errc::frame_size_error), "frame over the max frame size");
+    check(received(goaway_received) == static_cast<int>(http2_errc::frame_size_error), "GOAWAY with the frame size error");
+
+    io.stop();
+    io.join();
+    server.stop();
+    server.join();
+}
+
+int main() {
+    test_integers();
+    test_fields();
+    test_requests(false);
+    test_requests(true);
+    test_responses(false);
+    test_responses(true);
+    test_errors();
+    test_frames();
+
+    std::cout << (failures ? "failed: " : "passed") << (failures ? std::to_string(failures) : "") << std::endl;
+    return failures ? 1 : 0;
+}
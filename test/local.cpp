@@ -0,0 +1,477 @@
+#ifdef _MSC_VER
+#pragma warning(disable:4503)
+#endif
+
+#include <iostream>
+#include <future>
+
+#ifndef ASIO_POOL_HTTPS_IGNORE
+#define ASIO_POOL_HTTPS_IGNORE
+#endif
+
+// the client runs on io_context threads with the concrete executor, the other tests keep the type erased one
+#define ASIO_POOL_EXECUTOR boost::asio::io_context::executor_type
+
+#include "../src/http_pool.h"
+#include "local_server.h"
+#include <boost/beast/zlib/deflate_stream.hpp>
+#include <boost/crc.hpp>
+
+using namespace tms;
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& name) {
+    std::cout << (ok ? "ok     " : "FAILED ") << name << std::endl;
+    if (!ok) failures++;
+}
+
+// the server runs on its own thread, its sessions need no strand
+static asio::io_context io;
+static asio::thread_pool server(1);
+
+typedef std::function<void(http_error, http_stage, http_string_response&&)> string_handler;
+typedef http_request_t<http_empty_body, http_string_body, string_handler> string_request;
+
+struct result {
+    http_error err;
+    http_string_response response;
+};
+
+// a request made by the caller, e.g. with its fields, and its result
+static result run(http_client_pool& pool, const std::string& port, std::function<void(string_request&)> prepare, http_verb method, const std::string& target) {
+    auto promise = std::make_shared<std::promise<result> >();
+    auto future = promise->get_future();
+    auto req = std::make_shared<string_request>(method, target, [promise](http_error err, http_stage, http_string_response&& resp) {
+        promise->set_value(result{ err, std::move(resp) });
+    });
+    if (prepare) prepare(*req);
+    pool.enqueue("127.0.0.1", port, nullopt, req);
+    return future.get();
+}
+
+static result get(http_client_pool& pool, const std::string& port, const std::string& target, std::function<void(string_request&)> prepare = nullptr) {
+    return run(pool, port, std::move(prepare), http_verb::get, target);
+}
+
+//-------------------------------------------------------------------------------------------------
+// gzip and deflate content codings, the coded body goes one byte per write
+
+static std::string text(size_t size) {
+    std::string out;
+    for (int i = 0; out.size() < size; i++) {
+        out += "line " + std::to_string(i) + " of a compressible text\n";
+    }
+    out.resize(size);
+    return out;
+}
+
+static std::string deflate(const std::string& data) {
+    beast::zlib::deflate_stream stream;
+    std::string out(stream.upper_bound(data.size()), '\0');
+    beast::zlib::z_params zs;
+    zs.next_in = data.data();
+    zs.avail_in = data.size();
+    zs.next_out = &out[0];
+    zs.avail_out = out.size();
+    http_error ec;
+    stream.write(zs, beast::zlib::Flush::finish, ec);
+    out.resize(zs.total_out);
+    return out;
+}
+
+static std::string le32(uint32_t value) {
+    return std::string({ static_cast<char>(value), static_cast<char>(value >> 8), static_cast<char>(value >> 16), static_cast<char>(value >> 24) });
+}
+
+static std::string be32(uint32_t value) {
+    return std::string({ static_cast<char>(value >> 24), static_cast<char>(value >> 16), static_cast<char>(value >> 8), static_cast<char>(value) });
+}
+
+// member with the optional header parts of the flags
+static std::string gzip(const std::string& data, uint8_t flags = 0) {
+    std::string out = { '\x1f', '\x8b', 8, static_cast<char>(flags), 0, 0, 0, 0, 0, 3 };
+    if (flags & 4) out += std::string("\x04\0extr", 6);
+    if (flags & 8) out += std::string("name.txt\0", 9);
+    if (flags & 16) out += std::string("a comment\0", 10);
+    if (flags & 2) {
+        boost::crc_32_type crc;
+        crc.process_bytes(out.data(), out.size());
+        out += le32(crc.checksum()).substr(0, 2);
+    }
+    boost::crc_32_type crc;
+    crc.process_bytes(data.data(), data.size());
+    return out + deflate(data) + le32(crc.checksum()) + le32(static_cast<uint32_t>(data.size()));
+}
+
+static std::string zlib(const std::string& data) {
+    uint32_t a = 1, b = 0;
+    for (auto c : data) {
+        a = (a + static_cast<uint8_t>(c)) % 65521;
+        b = (b + a) % 65521;
+    }
+    return "\x78\x9c" + deflate(data) + be32((b << 16) | a);
+}
+
+// the body of the path, coded by its name
+static std::map<std::string, std::pair<std::string, std::string> > coded;
+
+static local_reply coded_reply(const local_request& req) {
+    auto ptr = coded.find(req.target);
+    if (ptr == coded.end()) return local_reply(local_server::response(404, "", ""));
+    auto& body = ptr->second.second;
+    local_reply reply(local_server::head(200, "Content-Encoding: " + ptr->second.first + "\r\n", body.size()));
+    for (auto c : body) {
+        reply.parts.push_back(std::string(1, c));
+    }
+    return reply;
+}
+
+static void test_decoding() {
+    auto plain = text(3000), second = text(700);
+    auto member = gzip(plain);
+    auto corrupt = member;
+    corrupt[corrupt.size() - 5] ^= 1;
+    auto adler = zlib(plain);
+    auto bad_adler = adler;
+    bad_adler[bad_adler.size() - 1] ^= 1;
+    coded = {
+        { "/gzip", { "gzip", member } },
+        { "/flags", { "gzip", gzip(plain, 2 | 4 | 8 | 16) } },
+        { "/members", { "gzip", member + gzip(second, 8) } },
+        { "/zlib", { "deflate", adler } },
+        { "/raw", { "deflate", deflate(plain) } },
+        { "/truncated", { "gzip", member.substr(0, member.size() - 3) } },
+        { "/crc", { "gzip", corrupt } },
+        { "/adler", { "deflate", bad_adler } }
+    };
+    local_server responder(server.get_executor(), coded_reply);
+    auto port = responder.port();
+    http_client_pool pool(io.get_executor(), 1);
+    auto decoded = [](string_request& req) {
+        req.decompress();
+    };
+
+    auto r = get(pool, port, "/gzip", decoded);
+    check(!r.err && r.response.body() == plain && r.response[http::field::content_encoding].empty(), "gzip");
+    r = get(pool, port, "/flags", decoded);
+    check(!r.err && r.response.body() == plain, "gzip with FHCRC, FEXTRA, FNAME and FCOMMENT");
+    r = get(pool, port, "/members", decoded);
+    check(!r.err && r.response.body() == plain + second, "gzip members one after another");
+    r = get(pool, port, "/zlib", decoded);
+    check(!r.err && r.response.body() == plain, "deflate in zlib format");
+    r = get(pool, port, "/raw", decoded);
+    check(!r.err && r.response.body() == plain, "raw deflate without the zlib header");
+    r = get(pool, port, "/truncated", decoded);
+    check(r.err == http::error::partial_message, "gzip cut in the trailer");
+    r = get(pool, port, "/crc", decoded);
+    check(r.err == beast::zlib::error::general, "gzip with a wrong CRC-32");
+    r = get(pool, port, "/adler", decoded);
+    check(r.err == beast::zlib::error::general, "deflate with a wrong Adler-32");
+    r = get(pool, port, "/gzip", [](string_request& req) {
+        req.decompress(true, 1000);
+    });
+    check(r.err == http::error::body_limit, "decoded body over the limit");
+    r = get(pool, port, "/gzip");
+    check(!r.err && r.response.body() == member && r.response[http::field::content_encoding] == "gzip", "coded body as is without decoding");
+}
+
+//-------------------------------------------------------------------------------------------------
+// response cache: each response tells the count of requests of its path the server got
+
+static std::string http_date(system_clock::time_point time) {
+    auto t = system_clock::to_time_t(time);
+    std::tm tm;
+#ifdef _WIN32
+    gmtime_s(&tm, &t);
+#else
+    gmtime_r(&t, &tm);
+#endif
+    char text[32];
+    std::strftime(text, sizeof(text), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return text;
+}
+
+static local_reply cache_reply(const local_request& req) {
+    static std::map<std::string, int> counts;   // of the server thread only
+    auto fields = "X-Count: " + std::to_string(++counts[req.target]) + "\r\n";
+    auto body = "body of " + req.target;
+    auto now = system_clock::now();
+    if (req.method != "GET") {
+        return local_reply(local_server::response(200, fields, ""));
+    }
+    if (req.target == "/max-age") {
+        fields += "Cache-Control: max-age=60\r\n";
+    }
+    else if (req.target == "/stale") {
+        // stale at once, the validator makes it fresh for a minute
+        if (req.field("if-none-match") == "\"v1\"") {
+            return local_reply(local_server::response(304, fields + "Cache-Control: max-age=60\r\nETag: \"v1\"\r\nX-Revalidated: yes\r\n", ""));
+        }
+        fields += "Cache-Control: max-age=0\r\nETag: \"v1\"\r\n";
+    }
+    else if (req.target == "/expires") {
+        fields += "Date: " + http_date(now) + "\r\nExpires: " + http_date(now + std::chrono::seconds(60)) + "\r\n";
+    }
+    else if (req.target == "/expired") {
+        fields += "Date: " + http_date(now) + "\r\nExpires: " + http_date(now) + "\r\n";
+    }
+    else if (req.target.compare(0, 5, "/lru/") == 0) {
+        fields += "Cache-Control: max-age=60\r\n";
+        body.resize(4000, '.');
+    }
+    return local_reply(local_server::response(200, fields, body));
+}
+
+static bool served(const result& r, const std::string& count) {
+    return !r.err && r.response.result_int() == 200 && r.response["x-count"] == count && r.response.body().compare(0, 8, "body of ") == 0;
+}
+
+static void test_cache() {
+    local_server responder(server.get_executor(), cache_reply);
+    auto port = responder.port();
+    http_client_pool pool(io.get_executor(), 1);
+    pool.set_cache(10000);
+
+    check(served(get(pool, port, "/max-age"), "1"), "max-age response stored");
+    check(served(get(pool, port, "/max-age"), "1"), "fresh response from the cache");
+    auto post = run(pool, port, nullptr, http_verb::post, "/max-age");
+    check(!post.err && post.response["x-count"] == "2", "POST goes to the server");
+    check(served(get(pool, port, "/max-age"), "3"), "POST invalidates the url");
+
+    check(served(get(pool, port, "/stale"), "1"), "stale response with ETag stored");
+    auto r = get(pool, port, "/stale");
+    check(served(r, "2") && r.response["x-revalidated"] == "yes" && r.response.body() == "body of /stale", "304 merges its fields into the cached response");
+    check(served(get(pool, port, "/stale"), "2"), "revalidated response fresh by the 304 max-age");
+
+    check(served(get(pool, port, "/expires"), "1"), "response with Expires and Date stored");
+    check(served(get(pool, port, "/expires"), "1"), "fresh till Expires");
+    check(served(get(pool, port, "/expired"), "1"), "Expires equal to Date");
+    check(served(get(pool, port, "/expired"), "2"), "expired response without validator not kept");
+
+    // two 4000 bytes bodies fit the budget, the third one evicts the least recently used
+    get(pool, port, "/lru/a");
+    get(pool, port, "/lru/b");
+    check(served(get(pool, port, "/lru/a"), "1"), "least recently used: a used again");
+    get(pool, port, "/lru/c");
+    check(served(get(pool, port, "/lru/a"), "1"), "recently used entry kept");
+    check(served(get(pool, port, "/lru/b"), "2"), "least recently used entry evicted");
+
+    auto stats = pool.get_stats().cache;
+    check(stats.revalidated == 1 && stats.evicted > 0 && stats.bytes <= 10000, "cache stats");
+}
+
+//-------------------------------------------------------------------------------------------------
+// pipelined requests on a connection the server closes after its first response
+
+static std::atomic<int> pipelined_served(0);
+
+static local_reply pipelined_reply(const local_request& req) {
+    pipelined_served++;
+    local_reply reply(local_server::response(200, "", "body of " + req.target));
+    reply.delay = std::chrono::milliseconds(50);    // the client writes the rest meanwhile
+    reply.close = true;
+    return reply;
+}
+
+static void test_pipeline() {
+    local_server responder(server.get_executor(), pipelined_reply);
+    auto port = responder.port();
+    http_client_pool pool(io.get_executor(), 1);
+    pool.set_pipeline(8);
+
+    static const int count = 8;
+    std::atomic<int> completions[count];
+    std::atomic<int> right(0), done(0);
+    auto promise = std::make_shared<std::promise<void> >();
+    for (int i = 0; i < count; i++) {
+        completions[i] = 0;
+        auto target = "/pipelined/" + std::to_string(i);
+        pool.enqueue<http_string_body>("127.0.0.1", port, target, nullopt, [i, target, &completions, &right, &done, promise](http_error err, http_stage, http_string_response&& resp) {
+            completions[i]++;
+            if (!err && resp.body() == "body of " + target) right++;
+            if (++done == count) promise->set_value();
+        });
+    }
+    promise->get_future().wait();
+
+    // a request completed twice would show up meanwhile
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    auto once = true;
+    for (auto& c : completions) {
+        once = once && c == 1;
+    }
+    check(once && done == count, "each of the pipelined requests completes once");
+    check(right == count && pipelined_served == count, "the requests the server did not answer are sent again");
+}
+
+//-------------------------------------------------------------------------------------------------
+// a request cancelled on its connection and a queued one past its deadline, the others are served
+
+static local_reply delayed_reply(const local_request& req) {
+    local_reply reply(local_server::response(200, "", "body of " + req.target));
+    if (req.target == "/slow") {
+        reply.delay = std::chrono::milliseconds(1000);
+    }
+    else if (req.target == "/stalled") {
+        reply.delay = std::chrono::milliseconds(3000);
+    }
+    return reply;
+}
+
+static void test_cancel() {
+    local_server responder(server.get_executor(), delayed_reply);
+    auto port = responder.port();
+    http_client_pool pool(io.get_executor(), 1);
+
+    typedef std::promise<std::pair<http_error, std::string> > promise_type;
+    auto request = [&pool, &port](const std::string& target, std::shared_ptr<promise_type> promise) {
+        return pool.enqueue<http_string_body>("127.0.0.1", port, target, nullopt, [promise](http_error err, http_stage, http_string_response&& resp) {
+            promise->set_value(std::make_pair(err, resp.body()));
+        });
+    };
+    auto slow = std::make_shared<promise_type>(), expiring = std::make_shared<promise_type>(), queued = std::make_shared<promise_type>(), after = std::make_shared<promise_type>();
+
+    // the slow one takes the only connection, the others wait behind it
+    auto sent = request("/slow", slow);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    auto started = steady_clock::now();
+    auto expiring_request = std::make_shared<string_request>(http_verb::get, "/expiring", [expiring](http_error err, http_stage, http_string_response&& resp) {
+        expiring->set_value(std::make_pair(err, resp.body()));
+    });
+    expiring_request->expires_after(std::chrono::milliseconds(200));
+    pool.enqueue("127.0.0.1", port, nullopt, expiring_request);
+    request("/queued", queued);
+
+    auto expired = expiring->get_future().get();
+    auto waited = steady_clock::now() - started;
+    check(expired.first == beast::error::timeout && waited < std::chrono::milliseconds(800), "queued request past its deadline ends with timeout");
+
+    sent->cancel();
+    auto cancelled = slow->get_future().get();
+    check(cancelled.first == asio::error::operation_aborted, "request in flight cancelled with operation_aborted");
+
+    auto served = queued->get_future().get();
+    check(!served.first && served.second == "body of /queued", "queued request served after the cancel");
+    request("/after", after);
+    served = after->get_future().get();
+    check(!served.first && served.second == "body of /after", "next request served");
+}
+
+//-------------------------------------------------------------------------------------------------
+// interactive requests: the reserved connection, or an idle shared one while the reserved is busy
+
+static void test_reserve() {
+    local_server responder(server.get_executor(), delayed_reply);
+    auto port = responder.port();
+    http_client_pool pool(io.get_executor(), 1);
+    pool.set_priority_reserve(true);
+
+    // the shared connection is open and waits for work
+    check(!get(pool, port, "/shared").err, "shared connection opened");
+
+    typedef std::promise<http_error> promise_type;
+    auto request = [&pool, &port](const std::string& target, std::shared_ptr<promise_type> promise) {
+        pool.enqueue<http_string_body>("127.0.0.1", port, target, nullopt, [promise](http_error err, http_stage, http_string_response&&) {
+            promise->set_value(err);
+        }, http_priority_interactive);
+    };
+    auto slow = std::make_shared<promise_type>(), fast = std::make_shared<promise_type>();
+    request("/slow", slow);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    auto started = steady_clock::now();
+    request("/fast", fast);
+    auto err = fast->get_future().get();
+    check(!err && steady_clock::now() - started < std::chrono::milliseconds(500), "interactive request not held up by the busy reserved connection");
+    check(!slow->get_future().get(), "slow interactive request served");
+}
+
+//-------------------------------------------------------------------------------------------------
+// read timeout of a connection: the stalled response is cut, sent again once and cut again,
+// requests before and after it are not
+
+static void test_timeout() {
+    local_server responder(server.get_executor(), delayed_reply);
+    auto port = responder.port();
+    http_client_pool pool(io.get_executor(), 1);
+    check(!get(pool, port, "/before").err, "request before the timeout served");
+
+    auto read = http_timeouts::read;
+    http_timeouts::read = 1;
+    auto started = steady_clock::now();
+    auto r = get(pool, port, "/stalled");
+    auto waited = steady_clock::now() - started;
+    check(r.err == beast::error::timeout && waited >= std::chrono::milliseconds(1900) && waited < std::chrono::milliseconds(2900), "stalled response ends with timeout after the retry");
+
+    r = get(pool, port, "/slow");
+    http_timeouts::read = read;
+    check(r.err == beast::error::timeout, "response slower than the timeout ends with timeout");
+    r = get(pool, port, "/slow");
+    check(!r.err && r.response.body() == "body of /slow", "slow response served with the default timeout");
+}
+
+//-------------------------------------------------------------------------------------------------
+// circuit breaker of a host refusing connections
+
+static void test_breaker() {
+    std::string port;
+    {
+        // nobody listens on the port once the acceptor is gone
+        tcp::acceptor acceptor(server, tcp_endpoint(asio::ip::make_address("127.0.0.1"), 0));
+        port = std::to_string(acceptor.local_endpoint().port());
+    }
+    http_client_pool pool(io.get_executor(), 4);
+    pool.set_circuit_breaker(3, std::chrono::milliseconds(300));
+
+    for (int i = 0; i < 3; i++) {
+        auto r = get(pool, port, "/refused");
+        check(r.err == asio::error::connection_refused, "connection refused " + std::to_string(i + 1));
+    }
+    auto started = steady_clock::now();
+    auto r = get(pool, port, "/refused");
+    check(r.err == http_pool_errc::circuit_open && steady_clock::now() - started < std::chrono::milliseconds(100), "open breaker fails the request at once");
+
+    // after the cool-down a single connection probes the host, the others wait for it and fail as it fails
+    std::this_thread::sleep_for(std::chrono::milliseconds(400));
+    std::vector<std::future<result> > waiting;
+    for (int i = 0; i < 4; i++) {
+        waiting.push_back(std::async(std::launch::async, [&pool, &port]() {
+            return get(pool, port, "/refused");
+        }));
+    }
+    size_t refused = 0, open = 0;
+    for (auto& w : waiting) {
+        auto err = w.get().err;
+        if (err == asio::error::connection_refused) refused++;
+        if (err == http_pool_errc::circuit_open) open++;
+    }
+    check(refused == 1 && open == 3, "single probe after the cool-down");
+    auto stats = pool.get_stats();
+    check(stats.hosts.size() == 1 && stats.hosts[0].circuit_opened == 2, "breaker opened again by the failed probe");
+}
+
+int main() {
+    auto work = asio::make_work_guard(io);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 2; i++) {
+        threads.emplace_back([]() { io.run(); });
+    }
+
+    test_decoding();
+    test_cache();
+    test_pipeline();
+    test_cancel();
+    test_reserve();
+    test_timeout();
+    test_breaker();
+
+    io.stop();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    server.stop();
+    server.join();
+
+    std::cout << (failures ? "failed: " : "passed") << (failures ? std::to_string(failures) : "") << std::endl;
+    return failures ? 1 : 0;
+}
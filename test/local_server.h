@@ -0,0 +1,152 @@
+#pragma once
+
+// local http/1.1 server of the tests, it runs on the executor given, e.g. of a thread of its own;
+// the reply of each request is written in its parts one by one, pipelined requests are read in turn
+
+#include <functional>
+#include <boost/asio/read.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/streambuf.hpp>
+
+namespace tms {
+    struct local_request {
+        std::string method;
+        std::string target;
+        std::string head;
+        std::string body;
+
+        // value of the field, empty if there is none
+        std::string field(const std::string& name) const {
+            auto pos = head.find("\r\n");
+            while (pos != std::string::npos && pos + 2 < head.size()) {
+                auto end = head.find("\r\n", pos + 2);
+                auto line = head.substr(pos + 2, end - pos - 2);
+                auto colon = line.find(':');
+                if (colon == name.size() && beast::iequals(line.substr(0, colon), name)) {
+                    auto value = line.find_first_not_of(' ', colon + 1);
+                    return value == std::string::npos ? std::string() : line.substr(value);
+                }
+                pos = end;
+            }
+            return std::string();
+        }
+    };
+
+    struct local_reply {
+        std::vector<std::string> parts;
+        std::chrono::milliseconds delay{ 0 };  // before the first part
+        bool close = false;                     // the connection is closed after the reply
+
+        local_reply() {}
+        local_reply(std::string text) {
+            parts.push_back(std::move(text));
+        }
+    };
+
+    class local_server {
+    public:
+        typedef std::function<local_reply(const local_request&)> handler_type;
+
+        local_server(const asio::any_io_executor& ex, handler_type h)
+            : acceptor(ex, tcp_endpoint(asio::ip::make_address("127.0.0.1"), 0)), handler(std::move(h))
+        {
+            accept();
+        }
+
+        std::string port() const {
+            return std::to_string(acceptor.local_endpoint().port());
+        }
+
+        // status line and fields, each of the fields ends with CRLF
+        static std::string head(unsigned status, const std::string& fields, size_t length) {
+            return "HTTP/1.1 " + std::to_string(status) + " " + std::string(http::obsolete_reason(http::int_to_status(status))) + "\r\n"
+                + fields + "Content-Length: " + std::to_string(length) + "\r\n\r\n";
+        }
+
+        static std::string response(unsigned status, const std::string& fields, const std::string& body) {
+            return head(status, fields, body.size()) + body;
+        }
+
+    private:
+        tcp::acceptor acceptor;
+        handler_type handler;
+
+        class session : public std::enable_shared_from_this<session> {
+        public:
+            session(tcp::socket s, handler_type& h) : socket(std::move(s)), timer(socket.get_executor()), handler(h) {}
+
+            void start() {
+                http_error ignored;
+                socket.set_option(tcp::no_delay(true), ignored);
+                auto self = this->shared_from_this();
+                asio::async_read_until(socket, buffer, "\r\n\r\n", [self](http_error err, size_t bytes) {
+                    if (err) return;
+                    auto data = static_cast<const char*>(self->buffer.data().data());
+                    self->request = local_request();
+                    self->request.head.assign(data, bytes);
+                    self->buffer.consume(bytes);
+                    std::istringstream line(self->request.head);
+                    line >> self->request.method >> self->request.target;
+                    auto length = self->request.field("content-length");
+                    self->read_body(length.empty() ? 0 : std::stoul(length));
+                });
+            }
+
+        private:
+            tcp::socket socket;
+            asio::steady_timer timer;
+            handler_type& handler;
+            asio::streambuf buffer;
+            local_request request;
+            local_reply reply;
+            size_t part = 0;
+
+            void read_body(size_t length) {
+                auto self = this->shared_from_this();
+                auto have = std::min(length, buffer.size());
+                asio::async_read(socket, buffer, asio::transfer_exactly(length - have), [self, length](http_error err, size_t) {
+                    if (err) return;
+                    auto data = static_cast<const char*>(self->buffer.data().data());
+                    self->request.body.assign(data, length);
+                    self->buffer.consume(length);
+                    self->reply = self->handler(self->request);
+                    self->part = 0;
+                    self->timer.expires_after(self->reply.delay);
+                    self->timer.async_wait([self](http_error) {
+                        self->write();
+                    });
+                });
+            }
+
+            void write() {
+                auto self = this->shared_from_this();
+                if (part == reply.parts.size()) {
+                    if (!reply.close) return start();
+                    http_error ignored;
+                    socket.shutdown(tcp::socket::shutdown_send, ignored);
+                    return drain();
+                }
+                asio::async_write(socket, asio::buffer(reply.parts[part++]), [self](http_error err, size_t) {
+                    if (!err) self->write();
+                });
+            }
+
+            // the rest is read till the peer closes, so the reply is not cut by a reset
+            void drain() {
+                auto self = this->shared_from_this();
+                buffer.consume(buffer.size());
+                socket.async_read_some(buffer.prepare(4096), [self](http_error err, size_t) {
+                    if (!err) self->drain();
+                });
+            }
+        };
+
+        void accept() {
+            acceptor.async_accept([this](http_error err, tcp::socket socket) {
+                if (err) return;
+                std::make_shared<session>(std::move(socket), handler)->start();
+                accept();
+            });
+        }
+    };
+}